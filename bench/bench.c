@@ -0,0 +1,198 @@
+/* See LICENSE file for copyright and license details. */
+#include <sys/resource.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <libparser.h>
+
+
+#define MIN_RUNS 3
+#define MIN_NANOSECONDS 200000000
+
+
+/* Defined next to the grammar, writes an input of at most size bytes and returns its length */
+size_t generate(char *buf, size_t size);
+
+/* Name of the grammar, defined with generate */
+extern const char *const grammar;
+
+static const size_t default_sizes[] = {1 << 10, 1 << 14, 1 << 18, 1 << 22};
+
+/* Incremented by libparser, which is compiled with malloc(3) et al. renamed to these */
+static size_t nmallocs = 0;
+static size_t nreallocs = 0;
+
+static size_t nbacktracks = 0;
+
+
+void *
+bench_malloc(size_t size)
+{
+	nmallocs += 1;
+	return malloc(size);
+}
+
+
+void *
+bench_calloc(size_t n, size_t size)
+{
+	nmallocs += 1;
+	return calloc(n, size);
+}
+
+
+void *
+bench_realloc(void *ptr, size_t size)
+{
+	if (ptr)
+		nreallocs += 1;
+	else
+		nmallocs += 1;
+	return realloc(ptr, size);
+}
+
+
+void
+bench_free(void *ptr)
+{
+	free(ptr);
+}
+
+
+static void
+free_tree(struct libparser_unit *unit)
+{
+	struct libparser_unit *next, *last;
+	for (; unit; unit = next) {
+		if (unit->in) {
+			for (last = unit->in; last->next; last = last->next);
+			last->next = unit->next;
+			unit->next = unit->in;
+		}
+		next = unit->next;
+		free(unit);
+	}
+}
+
+
+static void
+count_backtrack(const char *rule, size_t start, void *user)
+{
+	(void) rule;
+	(void) start;
+	(void) user;
+	nbacktracks += 1;
+}
+
+
+static unsigned long long int
+now(void)
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
+		perror("clock_gettime");
+		exit(1);
+	}
+	return (unsigned long long int)ts.tv_sec * 1000000000ULL + (unsigned long long int)ts.tv_nsec;
+}
+
+
+static void
+bench(size_t size)
+{
+	struct libparser_events events = {.retract = &count_backtrack};
+	struct libparser_unit *root;
+	struct rusage usage;
+	unsigned long long int start, elapsed, best = 0, total = 0;
+	size_t length, runs = 0, mallocs = 0, reallocs = 0;
+	char *data;
+	int ret;
+
+	data = malloc(size ? size : 1);
+	if (!data) {
+		perror("malloc");
+		exit(1);
+	}
+	length = generate(data, size);
+
+	do {
+		nmallocs = nreallocs = 0;
+		start = now();
+		ret = libparser_parse_file(libparser_rule_table, data, length, &root);
+		elapsed = now() - start;
+		if (ret < 0) {
+			perror("libparser_parse_file");
+			exit(1);
+		}
+		if (!runs) {
+			mallocs = nmallocs;
+			reallocs = nreallocs;
+		}
+		free_tree(root);
+		if (!runs || elapsed < best)
+			best = elapsed;
+		total += elapsed;
+		runs += 1;
+	} while (runs < MIN_RUNS || total < MIN_NANOSECONDS);
+
+	nbacktracks = 0;
+	if (libparser_parse_events(libparser_rule_table, data, length, NULL, &events) < 0) {
+		perror("libparser_parse_events");
+		exit(1);
+	}
+
+	if (getrusage(RUSAGE_SELF, &usage)) {
+		perror("getrusage");
+		exit(1);
+	}
+#ifdef __APPLE__
+	usage.ru_maxrss /= 1024;
+#endif
+
+	printf("grammar=%s bytes=%zu result=%i runs=%zu ns_per_byte=%.3f mb_per_s=%.3f "
+	       "peak_rss_kib=%li mallocs=%zu reallocs=%zu backtracks=%zu\n",
+	       grammar, length, ret, runs, length ? (double)best / (double)length : 0.0,
+	       best ? (double)length * 1000.0 / (double)best : 0.0,
+	       (long int)usage.ru_maxrss, mallocs, reallocs, nbacktracks);
+	fflush(stdout);
+
+	free(data);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	size_t i, size;
+	char *end;
+	int j;
+
+	if (argc > 1 && !strcmp(argv[1], "--")) {
+		argv[1] = argv[0];
+		argv++;
+		argc--;
+	}
+	for (j = 1; j < argc; j++) {
+		if (!isdigit((unsigned char)*argv[j]))
+			goto usage;
+		strtoull(argv[j], &end, 10);
+		if (*end)
+			goto usage;
+	}
+
+	if (argc < 2) {
+		for (i = 0; i < sizeof(default_sizes) / sizeof(*default_sizes); i++)
+			bench(default_sizes[i]);
+	}
+	for (j = 1; j < argc; j++) {
+		size = (size_t)strtoull(argv[j], NULL, 10);
+		bench(size);
+	}
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [size] ...\n", argv[0]);
+	return 1;
+}
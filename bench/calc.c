@@ -0,0 +1,36 @@
+/* See LICENSE file for copyright and license details. */
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+
+const char *const grammar = "calc";
+
+
+size_t
+generate(char *buf, size_t size)
+{
+	static const char *const ops[] = {" + ", " - ", " * ", " / ", "×", "−"};
+	unsigned long int r = 1;
+	size_t len = 0, n, op;
+	char term[64];
+
+	for (;;) {
+		r = (r * 1103515245UL + 12345UL) & 0x7FFFFFFFUL;
+		if (r % 5)
+			n = (size_t)sprintf(term, "%lu", r % 100000UL);
+		else
+			n = (size_t)sprintf(term, "(%lu%s%lu)", r % 1000UL, ops[(r >> 10) % 6], (r >> 12) % 1000UL);
+		op = (r >> 20) % 6;
+		if (len + (len ? strlen(ops[op]) : 0) + n > size)
+			break;
+		if (len) {
+			memcpy(&buf[len], ops[op], strlen(ops[op]));
+			len += strlen(ops[op]);
+		}
+		memcpy(&buf[len], term, n);
+		len += n;
+	}
+
+	return len;
+}
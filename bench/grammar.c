@@ -0,0 +1,36 @@
+/* See LICENSE file for copyright and license details. */
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+
+const char *const grammar = "grammar";
+
+
+size_t
+generate(char *buf, size_t size)
+{
+	static const char *const bodies[] = {
+		"\"keyword\", _, identifier",
+		"<\"a\", \"z\"> | <\"A\", \"Z\"> | \"_\" | <128, 255>",
+		"[sign], digit, {digit | \"_\" | \"'\"}",
+		"\"(*\", {!\"*)\", <0, 255>}, (\"*)\" | -)",
+		"(\"+\" | \"-\"), ^, term, {_, \",\", _, term}",
+		"%NUMBER, {%COMMA, %NUMBER}",
+		"\"\\x41\\101\\n\\\"\", [\"\\\\\" | \"\\n\"]",
+		"!(\"a\" | \"b\"), {(rule_a, rule_b | [rule_c]), _}"
+	};
+	size_t len = 0, n, i;
+	char rule[256];
+
+	for (i = 0;; i++) {
+		n = (size_t)sprintf(rule, "rule-%zu = %s; (* rule number %zu *)\n",
+		                    i, bodies[i % (sizeof(bodies) / sizeof(*bodies))], i);
+		if (len + n > size)
+			break;
+		memcpy(&buf[len], rule, n);
+		len += n;
+	}
+
+	return len;
+}
@@ -0,0 +1,37 @@
+/* See LICENSE file for copyright and license details. */
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+
+const char *const grammar = "json";
+
+
+size_t
+generate(char *buf, size_t size)
+{
+	unsigned long int r = 1;
+	size_t len, n;
+	char record[256];
+
+	if (size < 2)
+		return 0;
+	buf[0] = '[';
+	len = 1;
+
+	for (;;) {
+		r = (r * 1103515245UL + 12345UL) & 0x7FFFFFFFUL;
+		n = (size_t)sprintf(record, "%s\n  {\"id\": %lu, \"name\": \"item \\\"%lu\\\"\\n\", \"price\": %lu.%02lue-%lu,"
+		                    " \"tags\": [\"a\", \"b\\u00e9\"], \"stock\": %s, \"parent\": %s}",
+		                    len > 1 ? "," : "", r, r % 997UL, r % 10000UL, r % 100UL, r % 3UL,
+		                    r & 1 ? "true" : "false", r & 2 ? "null" : "{\"id\": -1, \"nested\": [[], {}]}");
+		if (len + n + 2 > size)
+			break;
+		memcpy(&buf[len], record, n);
+		len += n;
+	}
+
+	buf[len++] = '\n';
+	buf[len++] = ']';
+	return len;
+}
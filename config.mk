@@ -4,5 +4,6 @@ MANPREFIX = $(PREFIX)/share/man
 CC = c99
 
 CPPFLAGS = -D_DEFAULT_SOURCE -D_BSD_SOURCE -D_XOPEN_SOURCE=700 -I"$$(pwd)"
-CFLAGS   = -Wall -O2
+CFLAGS   = -Wall -O2 -pthread
 LDFLAGS  = -s
+LIBS     = -pthread
@@ -14,7 +14,7 @@ static const char *argv0 = "libparser-generate";
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: %s main-rule\n", argv0);
+	fprintf(stderr, "usage: %s [--emit-code] main-rule\n", argv0);
 	exit(1);
 }
 
@@ -29,12 +29,44 @@ struct token {
 	char s[];
 };
 
+struct literal {
+	char *string;
+	size_t length;
+	size_t index; /* index of the alternative */
+};
+
+struct trie {
+	size_t match;
+	size_t least;
+	size_t index;
+	struct trie *children[256];
+};
+
 struct node {
 	struct token *token;
 	struct node *parent;
 	struct node *next;
 	struct node *data;
 	struct node **head;
+	struct node *target;
+	unsigned char first[32];
+	char nullable;
+	unsigned char set[32];
+	char class_kind;
+	char class_state;
+	struct literal *literals;
+	size_t nliterals;
+};
+
+
+/* Node types that are not produced by the tokeniser */
+#define CHAR_SET_NODE '#'
+#define STRING_SET_NODE '$'
+
+enum {
+	NOT_A_CLASS,
+	CLASS,         /* matches one byte in .set and produces no units */
+	NEGATED_CLASS  /* matches the empty string unless the next byte is in .set, and produces no units */
 };
 
 
@@ -46,6 +78,22 @@ static char **want_rules = NULL;
 static size_t nwant_rules = 0;
 static size_t want_rules_size = 0;
 
+static char **rule_ids = NULL;
+static size_t nrule_ids = 0;
+static size_t rule_ids_size = 0;
+
+static char **token_types = NULL;
+static size_t ntoken_types = 0;
+static size_t token_types_size = 0;
+
+static struct node **rules = NULL;
+static size_t nrules = 0;
+static size_t rules_size = 0;
+
+static int emit_code_flag = 0;
+static int has_cut = 0;
+static int has_token = 0;
+
 
 static void *
 emalloc(size_t n)
@@ -105,6 +153,36 @@ strpcmp(const void *av, const void *bv)
 }
 
 
+static size_t
+get_rule_id(char *name, int declare)
+{
+	size_t i;
+	for (i = 0; i < nrule_ids; i++)
+		if (!strcmp(rule_ids[i], name))
+			return i;
+	if (nrule_ids == rule_ids_size)
+		rule_ids = ereallocarray(rule_ids, rule_ids_size += 16, sizeof(*rule_ids));
+	rule_ids[nrule_ids] = estrdup(name);
+	if (declare)
+		printf("static struct libparser_rule rule_%zu;\n", nrule_ids);
+	return nrule_ids++;
+}
+
+
+static size_t
+get_token_type_id(char *name)
+{
+	size_t i;
+	for (i = 0; i < ntoken_types; i++)
+		if (!strcmp(token_types[i], name))
+			return i;
+	if (ntoken_types == token_types_size)
+		token_types = ereallocarray(token_types, token_types_size += 16, sizeof(*token_types));
+	token_types[ntoken_types] = estrdup(name);
+	return ntoken_types++;
+}
+
+
 static int
 isidentifier(char c)
 {
@@ -239,7 +317,7 @@ tokenise(const char *data)
 			if (token_len == token_size)
 				token = erealloc(token, token_size += 16);
 			token[token_len++] = data[i];
-			if (isidentifier(data[i])) {
+			if (isidentifier(data[i]) || (data[i] == '%' && isidentifier(data[i + 1]))) {
 				state = IDENTIFIER;
 			} else if (isspace(data[i])) {
 				state = SPACE;
@@ -350,10 +428,125 @@ tokenise(const char *data)
 
 
 static void
-emit_and_free_sentence(struct node *node, size_t *indexp)
+emit_bitmap(const unsigned char bitmap[32])
+{
+	size_t i;
+	for (i = 0; i < 32; i++)
+		printf("%s0x%02x", i ? ", " : "", bitmap[i]);
+}
+
+
+static void
+emit_first_set(const unsigned char first[32], size_t rule, size_t index)
+{
+	printf("static struct libparser_first_set first_%zu_%zu = {.bytes = {", rule, index);
+	emit_bitmap(first);
+	printf("}, .nullable = 0};\n");
+}
+
+
+static size_t
+compute_trie_least(struct trie *trie)
+{
+	size_t c, least;
+	trie->least = 0;
+	for (c = 0; c < 256; c++) {
+		if (!trie->children[c])
+			continue;
+		least = compute_trie_least(trie->children[c]);
+		if (least && (!trie->least || least < trie->least))
+			trie->least = least;
+	}
+	return trie->match && (!trie->least || trie->match < trie->least) ? trie->match : trie->least;
+}
+
+
+/* Returns the nodes breadth-first, so that the children of each node are adjacent */
+static struct trie **
+build_trie(const struct node *node, size_t *np)
+{
+	struct trie **queue, *trie;
+	size_t i, j, c, n, nqueue = 1;
+
+	queue = emalloc(sizeof(*queue));
+	queue[0] = ecalloc(1, sizeof(**queue));
+	for (i = 0; i < node->nliterals; i++) {
+		trie = queue[0];
+		for (j = 0; j < node->literals[i].length; j++) {
+			c = (unsigned char)node->literals[i].string[j];
+			if (!trie->children[c]) {
+				trie->children[c] = ecalloc(1, sizeof(*trie));
+				queue = ereallocarray(queue, nqueue + 1, sizeof(*queue));
+				queue[nqueue++] = trie->children[c];
+			}
+			trie = trie->children[c];
+		}
+		if (!trie->match)
+			trie->match = node->literals[i].index + 1;
+	}
+	compute_trie_least(queue[0]);
+
+	for (i = 0, n = 1; i < nqueue; i++) {
+		for (c = 0; c < 256; c++) {
+			if (queue[i]->children[c]) {
+				queue[n] = queue[i]->children[c];
+				queue[n++]->index = c;
+			}
+		}
+	}
+
+	*np = nqueue;
+	return queue;
+}
+
+
+static void
+free_trie(struct trie **queue, size_t n)
+{
+	size_t i;
+	for (i = 0; i < n; i++)
+		free(queue[i]);
+	free(queue);
+}
+
+
+static void
+emit_and_free_string_set(struct node *node, size_t rule, size_t index)
+{
+	struct trie **queue;
+	size_t i, j, c, n, nqueue;
+
+	queue = build_trie(node, &nqueue);
+	for (i = 0; i < node->nliterals; i++)
+		free(node->literals[i].string);
+	free(node->literals);
+
+	printf("static struct libparser_string_set_node string_set_%zu_%zu[] = {\n", rule, index);
+	for (i = 0, n = 1; i < nqueue; i++) {
+		for (j = c = 0; c < 256; c++)
+			j += !!queue[i]->children[c];
+		printf("\t{.byte = 0x%02zx, .nchildren = %zu, .children = %zu, .match = %zu, .least = %zu},\n",
+		       queue[i]->index, j, n, queue[i]->match, queue[i]->least);
+		n += j;
+	}
+	printf("};\n");
+	printf("static union libparser_sentence sentence_%zu_%zu = {.string_set = {"
+	           ".type = LIBPARSER_SENTENCE_TYPE_STRING_SET, .nodes = string_set_%zu_%zu"
+	       "}};\n",
+	       rule, index, rule, index);
+
+	free_trie(queue, nqueue);
+}
+
+
+static void
+emit_and_free_sentence(struct node *node, size_t rule, size_t *indexp)
 {
-	size_t index = (*indexp)++, left, right;
-	struct node *next, *low, *high;
+	size_t index = (*indexp)++, left, right, id, count, i, *indices;
+	struct node *next, *low, *high, *link, **operands;
+	int has_first, has_left_first, has_right_first, has_firsts = 0;
+	unsigned char first[32], left_first[32], right_first[32];
+	char *with_first;
 
 	for (; node->token->s[0] == '('; node = next) {
 		next = node->data;
@@ -362,57 +555,133 @@ emit_and_free_sentence(struct node *node, size_t *indexp)
 	}
 
 	if (node->token->s[0] == '[' || node->token->s[0] == '{' || node->token->s[0] == '!') {
-		emit_and_free_sentence(node->data, indexp);
+		has_first = !node->data->nullable;
+		memcpy(first, node->data->first, sizeof(first));
+		emit_and_free_sentence(node->data, rule, indexp);
+		if (has_first)
+			emit_first_set(first, rule, index + 1);
 		printf("static union libparser_sentence sentence_%zu_%zu = {.unary = {"
-		           ".type = LIBPARSER_SENTENCE_TYPE_%s, .sentence = &sentence_%zu_%zu"
-		       "}};\n",
-		       nrule_names, index, node->token->s[0] == '[' ? "OPTIONAL" :
-		                           node->token->s[0] == '{' ? "REPEATED" : "REJECTION", nrule_names, index + 1);
+		           ".type = LIBPARSER_SENTENCE_TYPE_%s, .sentence = &sentence_%zu_%zu",
+		       rule, index, node->token->s[0] == '[' ? "OPTIONAL" :
+		                    node->token->s[0] == '{' ? "REPEATED" : "REJECTION", rule, index + 1);
+		if (has_first)
+			printf(", .first = &first_%zu_%zu", rule, index + 1);
+		printf("}};\n");
 	} else if (node->token->s[0] == '<') {
 		low = node->data;
 		high = node->data->next;
-		if ((unsigned char)low->token->s[0] > (unsigned char)high->token->s[0]) {
-			eprintf("%s: lower character range bound on line %zu at column %zu (character %zu) "
-			        "is greater than upper bound on line %zu at column %zu (character %zu)\n",
-			        argv0, low->token->lineno, low->token->column, low->token->character,
-			        high->token->lineno, high->token->column, high->token->character);
-		}
 		printf("static union libparser_sentence sentence_%zu_%zu = {.char_range = {"
 		           ".type = LIBPARSER_SENTENCE_TYPE_CHAR_RANGE, .low = %hhu, .high = %hhu"
 		       "}};\n",
-		       nrule_names, index, (unsigned char)low->token->s[0], (unsigned char)high->token->s[0]);
+		       rule, index, (unsigned char)low->token->s[0], (unsigned char)high->token->s[0]);
 		free(low->token);
 		free(high->token);
 		free(low);
 		free(high);
+	} else if ((node->token->s[0] == '|' || node->token->s[0] == ',') && node->data->token->s[0] == node->token->s[0]) {
+		/* a chain of the same operator is flattened into one sentence, its links are nested to the left */
+		for (count = 2, link = node->data; link->token->s[0] == node->token->s[0]; link = link->data)
+			count += 1;
+		operands = ereallocarray(NULL, count, sizeof(*operands));
+		for (i = count, link = node; i > 1; link = next) {
+			next = link->data;
+			operands[--i] = next->next;
+			if (link != node) {
+				free(link->token);
+				free(link);
+			}
+		}
+		operands[0] = link;
+
+		indices = ereallocarray(NULL, count, sizeof(*indices));
+		with_first = emalloc(count);
+		for (i = 0; i < count; i++) {
+			with_first[i] = node->token->s[0] == '|' && !operands[i]->nullable;
+			has_firsts |= with_first[i];
+			memcpy(first, operands[i]->first, sizeof(first));
+			indices[i] = *indexp;
+			emit_and_free_sentence(operands[i], rule, indexp);
+			if (with_first[i])
+				emit_first_set(first, rule, indices[i]);
+		}
+
+		printf("static const union libparser_sentence *const sentences_%zu_%zu[] = {", rule, index);
+		for (i = 0; i < count; i++)
+			printf("%s&sentence_%zu_%zu", i ? ", " : "", rule, indices[i]);
+		printf("};\n");
+		if (has_firsts) {
+			printf("static const struct libparser_first_set *const firsts_%zu_%zu[] = {", rule, index);
+			for (i = 0; i < count; i++) {
+				if (with_first[i])
+					printf("%s&first_%zu_%zu", i ? ", " : "", rule, indices[i]);
+				else
+					printf("%sNULL", i ? ", " : "");
+			}
+			printf("};\n");
+		}
+		printf("static union libparser_sentence sentence_%zu_%zu = {.nary = {"
+		           ".type = LIBPARSER_SENTENCE_TYPE_%s, .count = %zu, .sentences = sentences_%zu_%zu",
+		       rule, index, node->token->s[0] == '|' ? "CHOICE" : "SEQUENCE", count, rule, index);
+		if (has_firsts)
+			printf(", .first = firsts_%zu_%zu", rule, index);
+		printf("}};\n");
+
+		free(operands);
+		free(indices);
+		free(with_first);
 	} else if (node->token->s[0] == '|' || node->token->s[0] == ',') {
+		has_left_first = node->token->s[0] == '|' && !node->data->nullable;
+		has_right_first = node->token->s[0] == '|' && !node->data->next->nullable;
+		memcpy(left_first, node->data->first, sizeof(left_first));
+		memcpy(right_first, node->data->next->first, sizeof(right_first));
 		right = *indexp;
-		emit_and_free_sentence(node->data->next, indexp);
+		emit_and_free_sentence(node->data->next, rule, indexp);
 		left = *indexp;
-		emit_and_free_sentence(node->data, indexp);
+		emit_and_free_sentence(node->data, rule, indexp);
+		if (has_left_first)
+			emit_first_set(left_first, rule, left);
+		if (has_right_first)
+			emit_first_set(right_first, rule, right);
 		printf("static union libparser_sentence sentence_%zu_%zu = {.binary = {"
 		           ".type = LIBPARSER_SENTENCE_TYPE_%s, "
-		           ".left = &sentence_%zu_%zu, .right = &sentence_%zu_%zu"
-		       "}};\n",
-		       nrule_names, index, node->token->s[0] == '|' ? "ALTERNATION" : "CONCATENATION",
-		       nrule_names, left, nrule_names, right);
+		           ".left = &sentence_%zu_%zu, .right = &sentence_%zu_%zu",
+		       rule, index, node->token->s[0] == '|' ? "ALTERNATION" : "CONCATENATION",
+		       rule, left, rule, right);
+		if (has_left_first)
+			printf(", .left_first = &first_%zu_%zu", rule, left);
+		if (has_right_first)
+			printf(", .right_first = &first_%zu_%zu", rule, right);
+		printf("}};\n");
+	} else if (node->token->s[0] == CHAR_SET_NODE) {
+		printf("static union libparser_sentence sentence_%zu_%zu = {.char_set = {"
+		           ".type = LIBPARSER_SENTENCE_TYPE_CHAR_SET, .set = {", rule, index);
+		emit_bitmap(node->set);
+		printf("}}};\n");
+	} else if (node->token->s[0] == STRING_SET_NODE) {
+		emit_and_free_string_set(node, rule, index);
 	} else if (node->token->s[0] == '"') {
 		printf("static union libparser_sentence sentence_%zu_%zu = {.string = {"
 		           ".type = LIBPARSER_SENTENCE_TYPE_STRING, "
 		           ".string = %s\", .length = sizeof(%s\") - 1"
 		       "}};\n",
-		       nrule_names, index, node->token->s, node->token->s);
+		       rule, index, node->token->s, node->token->s);
 	} else if (node->token->s[0] == '-') {
 		printf("static union libparser_sentence sentence_%zu_%zu = {.type = LIBPARSER_SENTENCE_TYPE_EXCEPTION};\n",
-		       nrule_names, index);
+		       rule, index);
+	} else if (node->token->s[0] == '^') {
+		printf("static union libparser_sentence sentence_%zu_%zu = {.type = LIBPARSER_SENTENCE_TYPE_CUT};\n",
+		       rule, index);
+	} else if (node->token->s[0] == '%') {
+		printf("static union libparser_sentence sentence_%zu_%zu = {.token = {"
+		           ".type = LIBPARSER_SENTENCE_TYPE_TOKEN, .name = \"%s\", .id = %zu"
+		       "}};\n",
+		       rule, index, &node->token->s[1], get_token_type_id(&node->token->s[1]));
 	} else {
-		if (nwant_rules == want_rules_size)
-			want_rules = ereallocarray(want_rules, want_rules_size += 16, sizeof(*want_rules));
-		want_rules[nwant_rules++] = estrdup(node->token->s);
+		id = get_rule_id(node->token->s, 1);
 		printf("static union libparser_sentence sentence_%zu_%zu = {.rule = {"
-		           ".type = LIBPARSER_SENTENCE_TYPE_RULE, .rule = \"%s\""
+		           ".type = LIBPARSER_SENTENCE_TYPE_RULE, .rule = \"%s\", .target = &rule_%zu"
 		       "}};\n",
-		       nrule_names, index, node->token->s);
+		       rule, index, node->token->s, id);
 	}
 
 	free(node->token);
@@ -486,18 +755,1089 @@ order_sentences(struct node *node)
 
 
 static void
-emit_and_free_rule(struct node *rule)
+add_rule(struct node *rule)
 {
-	size_t index = 0;
-
 	rule->data = order_sentences(rule->data);
-	emit_and_free_sentence(rule->data, &index);
-
-	printf("static struct libparser_rule rule_%zu = {\"%s\", &sentence_%zu_0};\n", nrule_names, rule->token->s, nrule_names);
 
 	if (nrule_names == rule_names_size)
 		rule_names = ereallocarray(rule_names, rule_names_size += 16, sizeof(*rule_names));
 	rule_names[nrule_names++] = estrdup(rule->token->s);
+
+	if (nrules == rules_size)
+		rules = ereallocarray(rules, rules_size += 16, sizeof(*rules));
+	rules[nrules++] = rule;
+}
+
+
+static void
+resolve_references(struct node *node)
+{
+	size_t i;
+
+	switch (node->token->s[0]) {
+	case '(':
+	case '[':
+	case '{':
+	case '!':
+		resolve_references(node->data);
+		break;
+
+	case '|':
+	case ',':
+		resolve_references(node->data);
+		resolve_references(node->data->next);
+		break;
+
+	case '<':
+		if ((unsigned char)node->data->token->s[0] > (unsigned char)node->data->next->token->s[0]) {
+			eprintf("%s: lower character range bound on line %zu at column %zu (character %zu) "
+			        "is greater than upper bound on line %zu at column %zu (character %zu)\n",
+			        argv0, node->data->token->lineno, node->data->token->column, node->data->token->character,
+			        node->data->next->token->lineno, node->data->next->token->column,
+			        node->data->next->token->character);
+		}
+		break;
+
+	case '"':
+	case '-':
+	case '^':
+	case '%':
+	case CHAR_SET_NODE:
+	case STRING_SET_NODE:
+		break;
+
+	default:
+		if (nwant_rules == want_rules_size)
+			want_rules = ereallocarray(want_rules, want_rules_size += 16, sizeof(*want_rules));
+		want_rules[nwant_rules++] = estrdup(node->token->s);
+		for (i = 0; i < nrules; i++)
+			if (!strcmp(rules[i]->token->s, node->token->s))
+				node->target = rules[i];
+		break;
+	}
+}
+
+
+static unsigned char
+decode_escape(const char *s, size_t *np)
+{
+	unsigned val = 0;
+	size_t n = 1;
+
+	switch (s[0]) {
+	case 'a': val = '\a'; break;
+	case 'b': val = '\b'; break;
+	case 'f': val = '\f'; break;
+	case 'n': val = '\n'; break;
+	case 'r': val = '\r'; break;
+	case 't': val = '\t'; break;
+	case 'v': val = '\v'; break;
+	case 'x':
+	case 'X':
+		for (; isxdigit(s[n]); n++)
+			val = (val << 4) | (unsigned)((s[n] & 15) + (s[n] > '9' ? 9 : 0));
+		break;
+	default:
+		if ('0' <= s[0] && s[0] <= '7') {
+			for (n = 0; n < 3 && '0' <= s[n] && s[n] <= '7'; n++)
+				val = (val << 3) | (unsigned)(s[n] & 7);
+		} else {
+			val = (unsigned char)s[0];
+		}
+		break;
+	}
+
+	*np = n;
+	return (unsigned char)val;
+}
+
+
+static char *
+decode_string(const char *s, size_t *lenp)
+{
+	char *ret = emalloc(strlen(s) + 1);
+	size_t len = 0, n;
+
+	/* s[0] is '"' */
+	for (s++; *s; s += n) {
+		if (*s == '\\') {
+			ret[len++] = (char)decode_escape(&s[1], &n);
+			n += 1;
+		} else {
+			ret[len++] = *s;
+			n = 1;
+		}
+	}
+
+	*lenp = len;
+	return ret;
+}
+
+
+static void
+free_sentence(struct node *node)
+{
+	struct node *data, *next;
+	for (data = node->data; data; data = next) {
+		next = data->next;
+		free_sentence(data);
+	}
+	free(node->token);
+	free(node);
+}
+
+
+static struct node *
+new_node(const struct token *position, char type)
+{
+	struct node *node = ecalloc(1, sizeof(*node));
+	node->token = emalloc(offsetof(struct token, s) + 2);
+	node->token->lineno = position->lineno;
+	node->token->column = position->column;
+	node->token->character = position->character;
+	node->token->s[0] = type;
+	node->token->s[1] = '\0';
+	return node;
+}
+
+
+static int
+replace_with_char_set(struct node **nodep, const unsigned char set[32], int kind)
+{
+	struct node *old = *nodep, *new, *negation;
+
+	new = new_node(old->token, CHAR_SET_NODE);
+	memcpy(new->set, set, sizeof(new->set));
+	if (kind == NEGATED_CLASS) {
+		negation = new_node(old->token, '!');
+		negation->data = new;
+		memcpy(negation->set, set, sizeof(negation->set));
+		new = negation;
+	}
+
+	new->next = old->next;
+	old->next = NULL;
+	free_sentence(old);
+	*nodep = new;
+	return kind;
+}
+
+
+static int collapse_char_sets(struct node **nodep);
+
+
+static int
+collapse_rule_char_sets(struct node *rule)
+{
+	if (rule->class_state == 2)
+		return rule->class_kind;
+	if (rule->class_state == 1)
+		return NOT_A_CLASS; /* recursive */
+	rule->class_state = 1;
+	rule->class_kind = (char)collapse_char_sets(&rule->data);
+	memcpy(rule->set, rule->data->set, sizeof(rule->set));
+	rule->class_state = 2;
+	return rule->class_kind;
+}
+
+
+static int
+collapse_char_sets(struct node **nodep)
+{
+	struct node *node = *nodep;
+	int left, right;
+	unsigned c, high;
+	size_t i, len;
+	char *str;
+
+	switch (node->token->s[0]) {
+	case '(':
+		left = collapse_char_sets(&node->data);
+		memcpy(node->set, node->data->set, sizeof(node->set));
+		return left;
+
+	case '[':
+	case '{':
+		collapse_char_sets(&node->data);
+		return NOT_A_CLASS;
+
+	case '!':
+		if (collapse_char_sets(&node->data) != CLASS)
+			return NOT_A_CLASS;
+		memcpy(node->set, node->data->set, sizeof(node->set));
+		return NEGATED_CLASS;
+
+	case '|':
+		left = collapse_char_sets(&node->data);
+		right = collapse_char_sets(&node->data->next);
+		if (left != CLASS || right != CLASS)
+			return NOT_A_CLASS;
+		for (i = 0; i < sizeof(node->set); i++)
+			node->set[i] = node->data->set[i] | node->data->next->set[i];
+		return replace_with_char_set(nodep, node->set, CLASS);
+
+	case ',':
+		left = collapse_char_sets(&node->data);
+		right = collapse_char_sets(&node->data->next);
+		if (left != NEGATED_CLASS || right == NOT_A_CLASS)
+			return NOT_A_CLASS;
+		for (i = 0; i < sizeof(node->set); i++) {
+			if (right == NEGATED_CLASS)
+				node->set[i] = node->data->set[i] | node->data->next->set[i];
+			else
+				node->set[i] = (unsigned char)(~node->data->set[i] & node->data->next->set[i]);
+		}
+		return replace_with_char_set(nodep, node->set, right);
+
+	case '<':
+		memset(node->set, 0, sizeof(node->set));
+		high = (unsigned char)node->data->next->token->s[0];
+		for (c = (unsigned char)node->data->token->s[0]; c <= high; c++)
+			node->set[c >> 3] |= (unsigned char)(1 << (c & 7));
+		return CLASS;
+
+	case '"':
+		str = decode_string(node->token->s, &len);
+		c = (unsigned char)str[0];
+		free(str);
+		if (len != 1)
+			return NOT_A_CLASS;
+		memset(node->set, 0, sizeof(node->set));
+		node->set[c >> 3] |= (unsigned char)(1 << (c & 7));
+		return CLASS;
+
+	case CHAR_SET_NODE:
+		return CLASS;
+
+	case '-':
+	case '^':
+	case '%':
+		return NOT_A_CLASS;
+
+	default:
+		/* only hidden rules can be inlined as they do not produce units */
+		if (node->token->s[0] != '_' || collapse_rule_char_sets(node->target) == NOT_A_CLASS)
+			return NOT_A_CLASS;
+		return replace_with_char_set(nodep, node->target->set, node->target->class_kind);
+	}
+}
+
+
+static int
+is_literal(const struct node *node)
+{
+	for (; node->token->s[0] == '('; node = node->data);
+	return node->token->s[0] == '"' || node->token->s[0] == '<' || node->token->s[0] == CHAR_SET_NODE;
+}
+
+
+static void
+add_literal(struct node *set, char *string, size_t length, size_t index)
+{
+	set->literals = ereallocarray(set->literals, set->nliterals + 1, sizeof(*set->literals));
+	set->literals[set->nliterals].string = string;
+	set->literals[set->nliterals].length = length;
+	set->literals[set->nliterals++].index = index;
+}
+
+
+static struct node *
+new_string_set(struct node **alternatives, size_t n)
+{
+	struct node *set = new_node(alternatives[0]->token, STRING_SET_NODE), *node;
+	unsigned c, high;
+	size_t i, len;
+	char *str;
+
+	for (i = 0; i < n; i++) {
+		for (node = alternatives[i]; node->token->s[0] == '('; node = node->data);
+		if (node->token->s[0] == '"') {
+			str = decode_string(node->token->s, &len);
+			add_literal(set, str, len, i);
+		} else if (node->token->s[0] == '<') {
+			high = (unsigned char)node->data->next->token->s[0];
+			for (c = (unsigned char)node->data->token->s[0]; c <= high; c++) {
+				str = emalloc(1);
+				str[0] = (char)c;
+				add_literal(set, str, 1, i);
+			}
+		} else {
+			for (c = 0; c < 256; c++) {
+				if ((node->set[c >> 3] >> (c & 7)) & 1) {
+					str = emalloc(1);
+					str[0] = (char)c;
+					add_literal(set, str, 1, i);
+				}
+			}
+		}
+		free_sentence(alternatives[i]);
+	}
+
+	return set;
+}
+
+
+static void
+flatten_alternation(struct node *node, struct node ***listp, size_t *np)
+{
+	struct node *inner, *next, *left, *right;
+
+	for (inner = node; inner->token->s[0] == '('; inner = inner->data);
+	if (inner->token->s[0] != '|') {
+		*listp = ereallocarray(*listp, *np + 1, sizeof(**listp));
+		(*listp)[(*np)++] = node;
+		return;
+	}
+
+	/* the left operand is deallocated if it is an alternation itself */
+	left = inner->data;
+	right = left->next;
+	left->next = NULL;
+	flatten_alternation(left, listp, np);
+	flatten_alternation(right, listp, np);
+
+	for (; node != inner; node = next) {
+		next = node->data;
+		free(node->token);
+		free(node);
+	}
+	free(inner->token);
+	free(inner);
+}
+
+
+static void
+collapse_string_sets(struct node **nodep)
+{
+	struct node *node = *nodep, *next = node->next, **alternatives = NULL, *alternation;
+	size_t i, j, k, n = 0;
+
+	switch (node->token->s[0]) {
+	case '(':
+	case '[':
+	case '{':
+	case '!':
+		collapse_string_sets(&node->data);
+		return;
+
+	case ',':
+		collapse_string_sets(&node->data);
+		collapse_string_sets(&node->data->next);
+		return;
+
+	case '|':
+		break;
+
+	default:
+		return;
+	}
+
+	/* alternation is associative, so a chain can be regrouped
+	 * as long as the order of the alternatives is kept */
+	flatten_alternation(node, &alternatives, &n);
+	for (i = j = 0; i < n; i = k) {
+		for (k = i; k < n && is_literal(alternatives[k]); k++);
+		if (k - i > 1) {
+			alternatives[j++] = new_string_set(&alternatives[i], k - i);
+		} else if (k == i) {
+			alternatives[i]->next = NULL;
+			collapse_string_sets(&alternatives[i]);
+			alternatives[j++] = alternatives[k++];
+		} else {
+			alternatives[j++] = alternatives[i];
+		}
+	}
+
+	node = alternatives[0];
+	for (i = 1; i < j; i++) {
+		alternation = new_node(alternatives[i]->token, '|');
+		alternation->data = node;
+		node->next = alternatives[i];
+		alternatives[i]->next = NULL;
+		node = alternation;
+	}
+	node->next = next;
+	*nodep = node;
+	free(alternatives);
+}
+
+
+static void
+compute_first_set(struct node *node)
+{
+	unsigned c, high;
+	size_t i, len;
+	char *str;
+
+	switch (node->token->s[0]) {
+	case '(':
+		compute_first_set(node->data);
+		memcpy(node->first, node->data->first, sizeof(node->first));
+		node->nullable = node->data->nullable;
+		break;
+
+	case '[':
+	case '{':
+	case '!':
+		compute_first_set(node->data);
+		if (node->token->s[0] == '!')
+			memset(node->first, 0, sizeof(node->first));
+		else
+			memcpy(node->first, node->data->first, sizeof(node->first));
+		node->nullable = 1;
+		break;
+
+	case '|':
+	case ',':
+		compute_first_set(node->data);
+		compute_first_set(node->data->next);
+		memcpy(node->first, node->data->first, sizeof(node->first));
+		if (node->token->s[0] == '|' || node->data->nullable)
+			for (i = 0; i < sizeof(node->first); i++)
+				node->first[i] |= node->data->next->first[i];
+		if (node->token->s[0] == '|')
+			node->nullable = node->data->nullable || node->data->next->nullable;
+		else
+			node->nullable = node->data->nullable && node->data->next->nullable;
+		break;
+
+	case '<':
+		memset(node->first, 0, sizeof(node->first));
+		high = (unsigned char)node->data->next->token->s[0];
+		for (c = (unsigned char)node->data->token->s[0]; c <= high; c++)
+			node->first[c >> 3] |= (unsigned char)(1 << (c & 7));
+		node->nullable = 0;
+		break;
+
+	case '"':
+		memset(node->first, 0, sizeof(node->first));
+		str = decode_string(node->token->s, &len);
+		c = (unsigned char)str[0];
+		node->first[c >> 3] |= (unsigned char)(1 << (c & 7));
+		node->nullable = 0;
+		free(str);
+		break;
+
+	case '-':
+	case '^':
+		memset(node->first, 0, sizeof(node->first));
+		node->nullable = 1;
+		break;
+
+	case '%':
+		/* tokens are not bytes, so the first set is only used when parsing bytes */
+		memset(node->first, 0, sizeof(node->first));
+		node->nullable = 0;
+		break;
+
+	case CHAR_SET_NODE:
+		memcpy(node->first, node->set, sizeof(node->first));
+		node->nullable = 0;
+		break;
+
+	case STRING_SET_NODE:
+		memset(node->first, 0, sizeof(node->first));
+		for (i = 0; i < node->nliterals; i++) {
+			c = (unsigned char)node->literals[i].string[0];
+			node->first[c >> 3] |= (unsigned char)(1 << (c & 7));
+		}
+		node->nullable = 0;
+		break;
+
+	default:
+		memcpy(node->first, node->target->first, sizeof(node->first));
+		node->nullable = node->target->nullable;
+		break;
+	}
+}
+
+
+static void
+compute_first_sets(void)
+{
+	size_t i;
+	int changed;
+
+	for (i = 0; i < nrules; i++) {
+		memset(rules[i]->first, 0, sizeof(rules[i]->first));
+		rules[i]->nullable = 0;
+	}
+
+	do {
+		changed = 0;
+		for (i = 0; i < nrules; i++) {
+			compute_first_set(rules[i]->data);
+			if (memcmp(rules[i]->first, rules[i]->data->first, sizeof(rules[i]->first)) ||
+			    rules[i]->nullable != rules[i]->data->nullable) {
+				memcpy(rules[i]->first, rules[i]->data->first, sizeof(rules[i]->first));
+				rules[i]->nullable = rules[i]->data->nullable;
+				changed = 1;
+			}
+		}
+	} while (changed);
+}
+
+
+static size_t code_label;
+
+
+static void
+indent(int n)
+{
+	while (n--)
+		printf("\t");
+}
+
+
+static const struct node *
+skip_groups(const struct node *node)
+{
+	for (; node->token->s[0] == '('; node = node->data);
+	return node;
+}
+
+
+static size_t
+rule_index(const struct node *rule)
+{
+	size_t i;
+	for (i = 0; rules[i] != rule; i++);
+	return i;
+}
+
+
+/* Whether a rule's unit is replaced by its content where the rule is used */
+static int
+is_spliced(const struct node *rule)
+{
+	return rule->token->s[0] == '_' || skip_groups(rule->data)->token->s[0] == '!';
+}
+
+
+static int
+can_fail(const struct node *node)
+{
+	node = skip_groups(node);
+	switch (node->token->s[0]) {
+	case '[':
+	case '{':
+	case '-':
+		return 0;
+	case '|':
+		return can_fail(node->data) && can_fail(node->data->next);
+	default:
+		return 1;
+	}
+}
+
+
+static int
+uses_tail(const struct node *node)
+{
+	node = skip_groups(node);
+	switch (node->token->s[0]) {
+	case '"':
+	case '<':
+	case '-':
+	case CHAR_SET_NODE:
+	case STRING_SET_NODE:
+		return 0;
+	case '[':
+	case '{':
+		return uses_tail(node->data);
+	case '|':
+		return uses_tail(node->data) || (can_fail(node->data) && uses_tail(node->data->next));
+	default:
+		return 1;
+	}
+}
+
+
+static void
+emit_trie_code(const struct trie *trie, size_t depth, size_t best, size_t best_depth, size_t end, size_t fail, int n)
+{
+	size_t c;
+
+	if (trie->match && (!best || trie->match < best)) {
+		best = trie->match;
+		best_depth = depth;
+	}
+
+	if (trie->least && (!best || trie->least < best)) {
+		indent(n), printf("if (ctx->length - ctx->position > %zu) {\n", depth);
+		indent(n + 1), printf("switch (ctx->data[ctx->position + %zu]) {\n", depth);
+		for (c = 0; c < 256; c++) {
+			if (trie->children[c]) {
+				indent(n + 1), printf("case 0x%02zx:\n", c);
+				emit_trie_code(trie->children[c], depth + 1, best, best_depth, end, fail, n + 2);
+			}
+		}
+		indent(n + 1), printf("default:\n");
+		indent(n + 2), printf("break;\n");
+		indent(n + 1), printf("}\n");
+		indent(n), printf("}\n");
+	}
+
+	if (best) {
+		indent(n), printf("ctx->position += %zu;\n", best_depth);
+		indent(n), printf("goto end_%zu;\n", end);
+	} else {
+		indent(n), printf("goto fail_%zu;\n", fail);
+	}
+}
+
+
+static void
+emit_set_code(const unsigned char set[32], int n)
+{
+	indent(n), printf("static const unsigned char set[32] = {");
+	emit_bitmap(set);
+	printf("};\n");
+}
+
+
+/* Emits code that appends the sentence's units at *tail and
+ * advances tail on success, and otherwise restores the
+ * position and the list and jumps to fail_<fail> */
+static void
+emit_sentence_code(const struct node *node, size_t fail, int n)
+{
+	const struct node *operand;
+	struct trie **queue;
+	size_t id = code_label++, nqueue;
+	unsigned low, high;
+
+	node = skip_groups(node);
+	switch (node->token->s[0]) {
+	case ',':
+		indent(n), printf("{\n");
+		indent(n + 1), printf("size_t start_%zu = ctx->position;\n", id);
+		indent(n + 1), printf("struct libparser_unit **mark_%zu = tail;\n", id);
+		emit_sentence_code(node->data, fail, n + 1);
+		indent(n + 1), printf("if (ctx->done) {\n");
+		indent(n + 2), printf("if (!wrap(ctx, mark_%zu, &tail, start_%zu))\n", id, id);
+		indent(n + 3), printf("goto fail_%zu;\n", id);
+		indent(n + 1), printf("} else {\n");
+		emit_sentence_code(node->data->next, id, n + 2);
+		indent(n + 1), printf("}\n");
+		indent(n + 1), printf("goto end_%zu;\n", id);
+		indent(n), printf("fail_%zu:\n", id);
+		indent(n + 1), printf("discard(ctx, mark_%zu, &tail, start_%zu);\n", id, id);
+		indent(n + 1), printf("goto fail_%zu;\n", fail);
+		indent(n), printf("end_%zu:;\n", id);
+		indent(n), printf("}\n");
+		break;
+
+	case '|':
+		if (!can_fail(node->data)) {
+			emit_sentence_code(node->data, fail, n);
+			break;
+		}
+		emit_sentence_code(node->data, id, n);
+		indent(n), printf("goto end_%zu;\n", id);
+		indent(n - 1), printf("fail_%zu:\n", id);
+		emit_sentence_code(node->data->next, fail, n);
+		indent(n - 1), printf("end_%zu:;\n", id);
+		break;
+
+	case '!':
+		indent(n), printf("{\n");
+		indent(n + 1), printf("size_t start_%zu = ctx->position;\n", id);
+		indent(n + 1), printf("struct libparser_unit **mark_%zu = tail;\n", id);
+		emit_sentence_code(node->data, id, n + 1);
+		indent(n + 1), printf("discard(ctx, mark_%zu, &tail, start_%zu);\n", id, id);
+		indent(n + 1), printf("if (!ctx->exception)\n");
+		indent(n + 2), printf("goto fail_%zu;\n", fail);
+		indent(n + 1), printf("ctx->exception = 0;\n");
+		if (can_fail(node->data))
+			indent(n), printf("fail_%zu:;\n", id);
+		indent(n), printf("}\n");
+		break;
+
+	case '[':
+		emit_sentence_code(node->data, id, n);
+		if (can_fail(node->data))
+			indent(n - 1), printf("fail_%zu:;\n", id);
+		break;
+
+	case '{':
+		operand = skip_groups(node->data);
+		if (operand->token->s[0] == CHAR_SET_NODE || operand->token->s[0] == '<') {
+			indent(n), printf("{\n");
+			emit_set_code(operand->set, n + 1);
+			indent(n + 1), printf("while (ctx->position < ctx->length && IN_SET(set, ctx->data[ctx->position]))\n");
+			indent(n + 2), printf("ctx->position += 1;\n");
+			indent(n), printf("}\n");
+			break;
+		}
+		indent(n - 1), printf("loop_%zu:\n", id);
+		emit_sentence_code(node->data, id, n);
+		indent(n), printf("if (!ctx->done)\n");
+		indent(n + 1), printf("goto loop_%zu;\n", id);
+		if (can_fail(node->data))
+			indent(n - 1), printf("fail_%zu:;\n", id);
+		break;
+
+	case '<':
+		low = (unsigned char)node->data->token->s[0];
+		high = (unsigned char)node->data->next->token->s[0];
+		indent(n), printf("if (ctx->position == ctx->length");
+		if (low > 0)
+			printf(" || ctx->data[ctx->position] < %u", low);
+		if (high < 255)
+			printf(" || ctx->data[ctx->position] > %u", high);
+		printf(")\n");
+		indent(n + 1), printf("goto fail_%zu;\n", fail);
+		indent(n), printf("ctx->position += 1;\n");
+		break;
+
+	case CHAR_SET_NODE:
+		indent(n), printf("{\n");
+		emit_set_code(node->set, n + 1);
+		indent(n + 1), printf("if (ctx->position == ctx->length || !IN_SET(set, ctx->data[ctx->position]))\n");
+		indent(n + 2), printf("goto fail_%zu;\n", fail);
+		indent(n + 1), printf("ctx->position += 1;\n");
+		indent(n), printf("}\n");
+		break;
+
+	case STRING_SET_NODE:
+		queue = build_trie(node, &nqueue);
+		emit_trie_code(queue[0], 0, 0, 0, id, fail, n);
+		indent(n - 1), printf("end_%zu:;\n", id);
+		free_trie(queue, nqueue);
+		break;
+
+	case '"':
+		indent(n), printf("if (sizeof(%s\") - 1 > ctx->length - ctx->position ||\n", node->token->s);
+		indent(n), printf("    memcmp(&ctx->data[ctx->position], %s\", sizeof(%s\") - 1))\n",
+		                  node->token->s, node->token->s);
+		indent(n + 1), printf("goto fail_%zu;\n", fail);
+		indent(n), printf("ctx->position += sizeof(%s\") - 1;\n", node->token->s);
+		break;
+
+	case '-':
+		indent(n), printf("ctx->done = 1;\n");
+		indent(n), printf("ctx->exception = 1;\n");
+		break;
+
+	default:
+		indent(n), printf("{\n");
+		indent(n + 1), printf("struct libparser_unit *unit = parse_rule_%zu(ctx);\n", rule_index(node->target));
+		indent(n + 1), printf("if (!unit)\n");
+		indent(n + 2), printf("goto fail_%zu;\n", fail);
+		indent(n + 1), printf("add_unit(ctx, unit, &tail, %i);\n", is_spliced(node->target));
+		indent(n), printf("}\n");
+		break;
+	}
+}
+
+
+static void
+mark_used_rules(const struct node *node, char *used)
+{
+	size_t i;
+
+	switch (node->token->s[0]) {
+	case '(':
+	case '[':
+	case '{':
+	case '!':
+		mark_used_rules(node->data, used);
+		break;
+
+	case '|':
+	case ',':
+		mark_used_rules(node->data, used);
+		mark_used_rules(node->data->next, used);
+		break;
+
+	case '<':
+	case '"':
+	case '-':
+	case CHAR_SET_NODE:
+	case STRING_SET_NODE:
+		break;
+
+	default:
+		i = rule_index(node->target);
+		if (!used[i]) {
+			used[i] = 1;
+			mark_used_rules(node->target->data, used);
+		}
+		break;
+	}
+}
+
+
+static void
+emit_rule_code(const struct node *rule, size_t index)
+{
+	const struct node *sentence = skip_groups(rule->data);
+
+	printf("\n\nstatic struct libparser_unit *\nparse_rule_%zu(struct context *ctx)\n{\n", index);
+	printf("\tstruct libparser_unit *unit%s;\n\n", uses_tail(sentence) ? ", **tail" : "");
+	printf("\tunit = alloc_unit(ctx);\n");
+	printf("\tif (!unit)\n");
+	printf("\t\treturn NULL;\n");
+	if (sentence->token->s[0] == '!')
+		printf("\tunit->rule = NULL;\n");
+	else
+		printf("\tunit->rule = \"%s\";\n", rule->token->s);
+	printf("\tunit->start = ctx->position;\n");
+	if (uses_tail(sentence))
+		printf("\ttail = &unit->in;\n");
+	printf("\n");
+
+	code_label = 1;
+	emit_sentence_code(sentence, 0, 1);
+
+	printf("\n\tunit->end = ctx->position;\n");
+	if (uses_tail(sentence))
+		printf("\tctx->last = tail;\n");
+	printf("\treturn unit;\n");
+	if (can_fail(sentence)) {
+		printf("\nfail_0:\n");
+		printf("\tunit->next = ctx->cache;\n");
+		printf("\tctx->cache = unit;\n");
+		printf("\treturn NULL;\n");
+	}
+	printf("}\n");
+}
+
+
+static void
+emit_code(const char *main_rule)
+{
+	size_t i, main_index = 0;
+	char *used;
+
+	for (i = 0; i < nrules; i++)
+		if (!strcmp(rules[i]->token->s, main_rule))
+			main_index = i;
+
+	/* rules that have been inlined as character sets are not needed */
+	used = ecalloc(nrules, 1);
+	used[main_index] = 1;
+	mark_used_rules(rules[main_index]->data, used);
+
+	printf("\n\n"
+	       "#define IN_SET(SET, C) (((SET)[(C) >> 3] >> ((C) & 7)) & 1)\n"
+	       "\n"
+	       "struct context {\n"
+	       "\tstruct libparser_unit *cache;\n"
+	       "\tstruct libparser_unit **last; /* where the children of the last matched unit end */\n"
+	       "\tconst unsigned char *data;\n"
+	       "\tsize_t length;\n"
+	       "\tsize_t position;\n"
+	       "\tint done;\n"
+	       "\tint exception;\n"
+	       "\tint error;\n"
+	       "};\n"
+	       "\n"
+	       "\n"
+	       "static struct libparser_unit *\n"
+	       "alloc_unit(struct context *ctx)\n"
+	       "{\n"
+	       "\tstruct libparser_unit *unit;\n"
+	       "\tif (!ctx->cache) {\n"
+	       "\t\tunit = calloc(1, sizeof(*unit));\n"
+	       "\t\tif (!unit) {\n"
+	       "\t\t\tctx->done = 1;\n"
+	       "\t\t\tctx->error = 1;\n"
+	       "\t\t\treturn NULL;\n"
+	       "\t\t}\n"
+	       "\t} else {\n"
+	       "\t\tunit = ctx->cache;\n"
+	       "\t\tctx->cache = unit->next;\n"
+	       "\t\tunit->in = unit->next = NULL;\n"
+	       "\t}\n"
+	       "\treturn unit;\n"
+	       "}\n"
+	       "\n"
+	       "\n"
+	       "static void\n"
+	       "free_units(struct libparser_unit *unit, struct context *ctx)\n"
+	       "{\n"
+	       "\tstruct libparser_unit *prev;\n"
+	       "\twhile (unit) {\n"
+	       "\t\tfree_units(unit->in, ctx);\n"
+	       "\t\tprev = unit;\n"
+	       "\t\tunit = unit->next;\n"
+	       "\t\tprev->next = ctx->cache;\n"
+	       "\t\tctx->cache = prev;\n"
+	       "\t}\n"
+	       "}\n"
+	       "\n"
+	       "\n"
+	       "static void\n"
+	       "dealloc_units(struct libparser_unit *unit)\n"
+	       "{\n"
+	       "\tstruct libparser_unit *next;\n"
+	       "\tfor (; unit; unit = next) {\n"
+	       "\t\tdealloc_units(unit->in);\n"
+	       "\t\tnext = unit->next;\n"
+	       "\t\tfree(unit);\n"
+	       "\t}\n"
+	       "}\n"
+	       "\n"
+	       "\n"
+	       "/* Removes the units from *mark onwards */\n"
+	       "static void\n"
+	       "discard(struct context *ctx, struct libparser_unit **mark, struct libparser_unit ***tailp, size_t start)\n"
+	       "{\n"
+	       "\tfree_units(*mark, ctx);\n"
+	       "\t*mark = NULL;\n"
+	       "\t*tailp = mark;\n"
+	       "\tctx->position = start;\n"
+	       "}\n"
+	       "\n"
+	       "\n"
+	       "/* Wraps the units from *mark onwards in an anonymous unit, as the interpreter\n"
+	       " * does not unwrap the left operand of a concatenation that ends the parse */\n"
+	       "static int\n"
+	       "wrap(struct context *ctx, struct libparser_unit **mark, struct libparser_unit ***tailp, size_t start)\n"
+	       "{\n"
+	       "\tstruct libparser_unit *unit = alloc_unit(ctx);\n"
+	       "\tif (!unit)\n"
+	       "\t\treturn 0;\n"
+	       "\tunit->rule = NULL;\n"
+	       "\tunit->start = start;\n"
+	       "\tunit->end = ctx->position;\n"
+	       "\tunit->in = *mark;\n"
+	       "\t*mark = unit;\n"
+	       "\t*tailp = &unit->next;\n"
+	       "\treturn 1;\n"
+	       "}\n"
+	       "\n"
+	       "\n"
+	       "static void\n"
+	       "add_unit(struct context *ctx, struct libparser_unit *unit, struct libparser_unit ***tailp, int splice)\n"
+	       "{\n"
+	       "\tif (!splice) {\n"
+	       "\t\t**tailp = unit;\n"
+	       "\t\t*tailp = &unit->next;\n"
+	       "\t\treturn;\n"
+	       "\t}\n"
+	       "\t**tailp = unit->in;\n"
+	       "\tif (unit->in)\n"
+	       "\t\t*tailp = ctx->last;\n"
+	       "\tunit->next = ctx->cache;\n"
+	       "\tctx->cache = unit;\n"
+	       "}\n"
+	       "\n"
+	       "\n"
+	       "static struct libparser_unit *\n"
+	       "parse_special_rule(struct context *ctx, const char *name, int eof)\n"
+	       "{\n"
+	       "\tstruct libparser_unit *unit;\n"
+	       "\tif (eof && ctx->position != ctx->length)\n"
+	       "\t\treturn NULL;\n"
+	       "\tunit = alloc_unit(ctx);\n"
+	       "\tif (!unit)\n"
+	       "\t\treturn NULL;\n"
+	       "\tunit->rule = name;\n"
+	       "\tunit->start = unit->end = ctx->position;\n"
+	       "\tctx->done = 1;\n"
+	       "\tctx->exception = !eof;\n"
+	       "\treturn unit;\n"
+	       "}\n"
+	       "\n");
+
+	for (i = 0; i < nrules; i++)
+		if (used[i])
+			printf("\nstatic struct libparser_unit *parse_rule_%zu(struct context *ctx);", i);
+	printf("\n");
+	for (i = 0; i < nrules; i++)
+		if (used[i])
+			emit_rule_code(rules[i], i);
+	free(used);
+
+	printf("\n\n"
+	       "static struct libparser_unit *\n"
+	       "parse_start(struct context *ctx)\n"
+	       "{\n"
+	       "\tstruct libparser_unit *unit, *sub, **tail;\n"
+	       "\n"
+	       "\tunit = alloc_unit(ctx);\n"
+	       "\tif (!unit)\n"
+	       "\t\treturn NULL;\n"
+	       "\tunit->rule = \"@start\";\n"
+	       "\tunit->start = ctx->position;\n"
+	       "\ttail = &unit->in;\n"
+	       "\n"
+	       "\tsub = parse_rule_%zu(ctx);\n"
+	       "\tif (!sub)\n"
+	       "\t\tgoto fail;\n"
+	       "\tadd_unit(ctx, sub, &tail, %i);\n"
+	       "\tif (ctx->done) {\n"
+	       "\t\tif (!wrap(ctx, &unit->in, &tail, unit->start))\n"
+	       "\t\t\tgoto fail;\n"
+	       "\t} else {\n"
+	       "\t\tsub = parse_special_rule(ctx, \"@eof\", 1);\n"
+	       "\t\tif (!sub && !ctx->error)\n"
+	       "\t\t\tsub = parse_special_rule(ctx, \"@noeof\", 0);\n"
+	       "\t\tif (!sub)\n"
+	       "\t\t\tgoto fail;\n"
+	       "\t\tadd_unit(ctx, sub, &tail, 0);\n"
+	       "\t}\n"
+	       "\n"
+	       "\tunit->end = ctx->position;\n"
+	       "\treturn unit;\n"
+	       "\n"
+	       "fail:\n"
+	       "\tdiscard(ctx, &unit->in, &tail, unit->start);\n"
+	       "\tunit->next = ctx->cache;\n"
+	       "\tctx->cache = unit;\n"
+	       "\treturn NULL;\n"
+	       "}\n"
+	       "\n"
+	       "\n"
+	       "int\n"
+	       "libparser_parse_file_compiled(const char *data, size_t length, struct libparser_unit **rootp)\n"
+	       "{\n"
+	       "\tstruct libparser_unit *ret, *t;\n"
+	       "\tstruct context ctx;\n"
+	       "\n"
+	       "\tctx.cache = NULL;\n"
+	       "\tctx.last = NULL;\n"
+	       "\tctx.data = (const unsigned char *)data;\n"
+	       "\tctx.length = length;\n"
+	       "\tctx.position = 0;\n"
+	       "\tctx.done = 0;\n"
+	       "\tctx.exception = 0;\n"
+	       "\tctx.error = 0;\n"
+	       "\n"
+	       "\tret = parse_start(&ctx);\n"
+	       "\n"
+	       "\twhile (ctx.cache) {\n"
+	       "\t\tt = ctx.cache;\n"
+	       "\t\tctx.cache = t->next;\n"
+	       "\t\tfree(t);\n"
+	       "\t}\n"
+	       "\n"
+	       "\tif (ctx.error) {\n"
+	       "\t\tdealloc_units(ret);\n"
+	       "\t\t*rootp = NULL;\n"
+	       "\t\treturn -1;\n"
+	       "\t}\n"
+	       "\n"
+	       "\t*rootp = ret;\n"
+	       "\treturn !ctx.exception;\n"
+	       "}\n"
+	       "\n\n", main_index, is_spliced(rules[main_index]));
+}
+
+
+static void
+emit_and_free_rule(struct node *rule, size_t index)
+{
+	size_t sentence = 0;
+
+	emit_and_free_sentence(rule->data, index, &sentence);
+
+	printf("static struct libparser_rule rule_%zu = {\"%s\", &sentence_%zu_0};\n",
+	       get_rule_id(rule->token->s, 0), rule->token->s, index);
+
 	free(rule->token);
 	free(rule);
 }
@@ -531,11 +1871,16 @@ main(int argc, char *argv[])
 		argv0 = *argv++;
 		argc--;
 	}
-	if (argc && argv[0][0] == '-') {
-		if (argv[0][1] != '-' || argv[0][2])
+	for (; argc && argv[0][0] == '-'; argv++, argc--) {
+		if (!strcmp(argv[0], "--")) {
+			argv++;
+			argc--;
+			break;
+		} else if (!strcmp(argv[0], "--emit-code")) {
+			emit_code_flag = 1;
+		} else {
 			usage();
-		argv++;
-		argc--;
+		}
 	}
 
 	if (argc != 1 || !isidentifier(argv[0][0]))
@@ -549,6 +1894,10 @@ main(int argc, char *argv[])
 	free(data);
 
 	printf("#include <libparser.h>\n");
+	if (emit_code_flag) {
+		printf("#include <stdlib.h>\n");
+		printf("#include <string.h>\n");
+	}
 
 	i = 0;
 again:
@@ -620,6 +1969,13 @@ again:
 					stack->head = &stack->data;
 				} else if (tokens[i]->s[0] == '-') {
 					goto add;
+				} else if (tokens[i]->s[0] == '^') {
+					has_cut = 1;
+					goto add;
+				} else if (tokens[i]->s[0] == '%' && tokens[i]->s[1]) {
+					has_token = 1;
+					get_token_type_id(&tokens[i]->s[1]);
+					goto add;
 				} else if (tokens[i]->s[0] == '!') {
 					goto push_stack;
 				} else {
@@ -669,7 +2025,7 @@ again:
 					        "'%s' on line %zu at column %zu (character %zu) not closed\n",
 					        argv0, tokens[i]->lineno, tokens[i]->column, tokens[i]->character, stack->token->s,
 					        stack->token->lineno, stack->token->column, stack->token->character);
-				emit_and_free_rule(stack);
+				add_rule(stack);
 				free(tokens[i]);
 				state = NEW_RULE;
 			} else {
@@ -783,6 +2139,9 @@ again:
 	if (state != NEW_RULE)
 		eprintf("%s: premature end of file\n", argv0);
 
+	for (i = 0; i < nrules; i++)
+		resolve_references(rules[i]->data);
+
 	err = 0;
 	qsort(rule_names, nrule_names, sizeof(*rule_names), strpcmp);
 	qsort(want_rules, nwant_rules, sizeof(*want_rules), strpcmp);
@@ -823,16 +2182,32 @@ again:
 	eprintf("%s: specified main rule (\"%s\") was not defined\n", argv0, argv[0]);
 
 found_main:
+	for (i = 0; i < nrules; i++)
+		collapse_rule_char_sets(rules[i]);
+	for (i = 0; i < nrules; i++)
+		collapse_string_sets(&rules[i]->data);
+	compute_first_sets();
+	if (emit_code_flag) {
+		if (has_cut)
+			eprintf("%s: cuts ('^') cannot be used with --emit-code\n", argv0);
+		if (has_token)
+			eprintf("%s: token types ('%%') cannot be used with --emit-code\n", argv0);
+		emit_code(argv[0]);
+	}
+	for (i = 0; i < nrules; i++)
+		emit_and_free_rule(rules[i], i);
+	free(rules);
+
 	printf("static union libparser_sentence noeof_sentence = {.type = LIBPARSER_SENTENCE_TYPE_EXCEPTION};\n");
 	printf("static struct libparser_rule noeof_rule = {\"@noeof\", &noeof_sentence};\n");
 	printf("static union libparser_sentence noeof_rule_sentence = {.rule = "
-	           "{.type = LIBPARSER_SENTENCE_TYPE_RULE, .rule = \"@noeof\"}"
+	           "{.type = LIBPARSER_SENTENCE_TYPE_RULE, .rule = \"@noeof\", .target = &noeof_rule}"
 	       "};\n");
 
 	printf("static union libparser_sentence eof_sentence = {.type = LIBPARSER_SENTENCE_TYPE_EOF};\n");
 	printf("static struct libparser_rule eof_rule = {\"@eof\", &eof_sentence};\n");
 	printf("static union libparser_sentence eof_rule_sentence = {.rule = "
-	           "{.type = LIBPARSER_SENTENCE_TYPE_RULE, .rule = \"@eof\"}"
+	           "{.type = LIBPARSER_SENTENCE_TYPE_RULE, .rule = \"@eof\", .target = &eof_rule}"
 	       "};\n");
 
 	printf("static union libparser_sentence end_sentence = {.binary = {"
@@ -841,8 +2216,8 @@ found_main:
 	       "}};\n");
 
 	printf("static union libparser_sentence main_rule_sentence = {.rule = "
-	           "{.type = LIBPARSER_SENTENCE_TYPE_RULE, .rule = \"%s\"}"
-	       "};\n", argv[0]);
+	           "{.type = LIBPARSER_SENTENCE_TYPE_RULE, .rule = \"%s\", .target = &rule_%zu}"
+	       "};\n", argv[0], get_rule_id(argv[0], 0));
 
 	printf("static union libparser_sentence main_sentence = {.binary = {"
 	           ".type = LIBPARSER_SENTENCE_TYPE_CONCATENATION, "
@@ -850,15 +2225,27 @@ found_main:
 	       "}};\n");
 	printf("static struct libparser_rule main_rule = {\"@start\", &main_sentence};\n");
 
+	/* @start is put first so that libparser_parse_file(3) finds it immediately */
 	printf("const struct libparser_rule *const libparser_rule_table[] = {\n");
-	for (i = 0; i < nrule_names; i++) {
+	printf("\t&main_rule,\n");
+	for (i = 0; i < nrule_ids; i++) {
 		printf("\t&rule_%zu,\n", i);
-		free(rule_names[i]);
+		free(rule_ids[i]);
 	}
 	printf("\t&eof_rule,\n");
 	printf("\t&noeof_rule,\n");
-	printf("\t&main_rule,\n");
 	printf("\tNULL\n};\n");
+	free(rule_ids);
+
+	printf("const char *const libparser_token_type_table[] = {\n");
+	for (i = 0; i < ntoken_types; i++) {
+		printf("\t\"%s\",\n", token_types[i]);
+		free(token_types[i]);
+	}
+	printf("\tNULL\n};\n");
+	free(token_types);
+	for (i = 0; i < nrule_names; i++)
+		free(rule_names[i]);
 	free(rule_names);
 	for (i = 0; i < nwant_rules; i++)
 		free(want_rules[i]);
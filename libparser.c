@@ -1,31 +1,218 @@
 /* See LICENSE file for copyright and license details. */
 #include "libparser.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__GNUC__) && defined(__x86_64__)
+# define HAVE_X86_SIMD
+# include <immintrin.h>
+#endif
 
 
+#define ARENA_MIN_BLOCK_UNITS 32
+#define ARENA_MAX_BLOCK_UNITS 65536
+
+#define SCAN_MAX_RANGES 4
+#define SCAN_CACHE_SIZE 8
+#define SCAN_SCALAR_PREFIX 16
+
+#define IN_SET(SET, C) (((SET)[(C) >> 3] >> ((C) & 7)) & 1)
+
+#define NO_FRAME SIZE_MAX
+#define CAN_FAIL_MAX_RULES 8
+#define CURRENT(CTX) ((const unsigned char *)&(CTX)->data[(CTX)->position - (CTX)->offset])
+
+
+/* Precomputed tables for scanning runs of bytes in a set */
+struct byte_class {
+	const void *key; /* NULL if unused */
+	unsigned char set[32];
+	unsigned char nranges; /* 0 if the set is not made up of at most SCAN_MAX_RANGES ranges */
+	unsigned char low[SCAN_MAX_RANGES];
+	unsigned char width[SCAN_MAX_RANGES]; /* high - low */
+	unsigned char truffle_low[16]; /* bit (c >> 4) in truffle_low[c & 15] is set if c < 128 is in the set */
+	unsigned char truffle_high[16]; /* bit ((c >> 4) & 7) in truffle_high[c & 15] is set if c >= 128 is in the set */
+};
+
+
+struct memo_entry {
+	struct memo_entry *next; /* next entry in the same bucket, or unused entry */
+	const struct libparser_rule *rule;
+	size_t position;
+	size_t end;
+	struct libparser_unit *unit; /* first unit of the result, which is not owned by the entry, NULL if none */
+	struct libparser_unit *last; /* last unit of the result, which continues at .unit->next */
+	char matched;
+};
+
+struct memo_block {
+	struct memo_block *next;
+	size_t count;
+	size_t used; /* entries used, the rest are unused */
+	struct memo_entry entries[];
+};
+
+struct memo {
+	struct memo_entry **buckets; /* by position, so that results at nearby positions are near each other */
+	size_t size; /* 0 or a power of two */
+	size_t count;
+	struct memo_block *blocks; /* the first block is the last allocated */
+	struct memo_entry *unused; /* entries dropped after a cut */
+	size_t stored; /* number of times an entry has been made to refer to units */
+	size_t used; /* bytes */
+	size_t limit; /* bytes, 0 for unlimited */
+	size_t floor; /* results before this position are dropped when the table is grown */
+	struct libparser_unit *orphans; /* units backtracked over that results may be in, as a list */
+	char full;
+};
+
+struct arena_block {
+	struct arena_block *next;
+	size_t size; /* bytes, including this header */
+	struct libparser_unit units[];
+};
+
+struct libparser_tree {
+	struct libparser_allocator allocator;
+	struct arena_block *blocks;
+	struct libparser_unit *free_units;
+	struct libparser_unit *end_units;
+	size_t block_units;
+};
+
+struct libparser_profile {
+	struct libparser_rule_profile *rules; /* hash table, .rule is NULL in unused slots */
+	size_t size; /* 0 or a power of two */
+	size_t count;
+	struct libparser_rule_profile *sorted; /* returned by libparser_profile_rules */
+};
+
+enum frame_state {
+	FRAME_ENTER,
+	FRAME_CONCATENATION_LEFT,
+	FRAME_CONCATENATION_RIGHT,
+	FRAME_ALTERNATION_LEFT,
+	FRAME_ALTERNATION_RIGHT,
+	FRAME_SEQUENCE,
+	FRAME_CHOICE,
+	FRAME_REJECTION,
+	FRAME_OPTIONAL,
+	FRAME_REPEATED,
+	FRAME_RULE
+};
+
+/* try_match call, suspended while a subsentence is matched */
+struct frame {
+	const union libparser_sentence *sentence;
+	struct libparser_unit *unit;
+	struct libparser_unit *last; /* last unit in .unit->in, so that units can be appended without a walk */
+	const struct libparser_rule *target; /* for LIBPARSER_SENTENCE_TYPE_RULE */
+	size_t memoised; /* .stored in the memo when the frame was entered */
+	enum frame_state state;
+	size_t index; /* operand being matched, for LIBPARSER_SENTENCE_TYPE_SEQUENCE and LIBPARSER_SENTENCE_TYPE_CHOICE */
+	size_t events; /* .nevents in the context when the frame was entered */
+	size_t profiled; /* .nprofiled in the context when the frame was entered */
+	uint64_t began; /* time the rule was entered, for LIBPARSER_SENTENCE_TYPE_RULE when profiling */
+	char safe; /* whether no frame below will fail if this frame matches */
+	char embedded; /* whether .unit is .self, because the unit will not be in the parse tree */
+	struct libparser_unit self;
+};
+
+/* Rule entered with libparser_parse_events, that may yet be retracted */
+struct event {
+	const char *rule;
+	size_t start;
+};
+
+/* Match of a rule while profiling, that may yet be backtracked over */
+struct profiled {
+	const struct libparser_rule *rule;
+	size_t length;
+};
+
+/* Unit whose copy is pending in copy_unit */
+struct copy_frame {
+	const struct libparser_unit *unit;
+	struct libparser_unit **head;
+};
+
 struct context {
 	const struct libparser_rule *const *rules;
 	struct libparser_unit *cache;
-	const char *data;
-	size_t length;
+	struct frame *frames;
+	size_t depth;
+	size_t frames_size;
+	size_t max_depth;
+	size_t steps; /* number of frames pushed */
+	size_t max_steps;
+	size_t units; /* number of units in use */
+	size_t max_units;
+	size_t yield_steps; /* for streams, number of steps to take before yielding, 0 for no limit */
+	size_t yield_at; /* value of .steps at which to yield, SIZE_MAX if never */
+	struct copy_frame *copies;
+	size_t copies_size;
+	struct libparser_tree *tree;
+	struct memo *memo;
+	struct byte_class classes[SCAN_CACHE_SIZE];
+	const char *data; /* the byte at position .offset */
+	const struct libparser_token *tokens; /* input, instead of .data, for libparser_parse_tokens */
+	size_t offset;
+	size_t length; /* position of the end of .data */
 	size_t position;
+	size_t stream_depth; /* index of the frame whose units are handed to .callback, NO_FRAME if none */
+	size_t cut_depth; /* number of frames that may not fail since a cut was passed */
+	size_t rejections; /* number of frames matching the operand of a rejection */
+	size_t recognise_depth; /* index of the first frame that only recognises its input, NO_FRAME if none */
+	void (*callback)(struct libparser_unit *unit, const char *text, void *user);
+	void *user;
+	const struct libparser_events *events;
+	struct event *log; /* .log[0] is event number .events_base */
+	size_t log_size;
+	size_t nevents;
+	size_t events_base; /* events before this can no longer be retracted */
+	struct libparser_profile *profile;
+	struct profiled *profiled;
+	size_t profiled_size;
+	size_t nprofiled;
+	char final; /* whether .data ends at the end of the input */
 	char done;
 	char exception;
-	char error;
+	char limited; /* whether .error was set because a limit in the options was reached */
+	char yielded; /* whether run_frames returned because .yield_at was reached */
+	int error; /* errno value, 0 if none */
 };
 
 
+/* Move the units in unit->in in front of unit->next, so
+ * that a tree can be walked as a list without recursion */
+static struct libparser_unit *
+unnest_unit(struct libparser_unit *unit)
+{
+	struct libparser_unit *last;
+	if (unit->in) {
+		for (last = unit->in; last->next; last = last->next);
+		last->next = unit->next;
+		unit->next = unit->in;
+		unit->in = NULL;
+	}
+	return unit->next;
+}
+
+
 static void
 free_unit(struct libparser_unit *unit, struct context *ctx)
 {
-	struct libparser_unit *prev;
-	while (unit) {
-		free_unit(unit->in, ctx);
-		prev = unit;
-		unit = unit->next;
-		prev->next = ctx->cache;
-		ctx->cache = prev;
+	struct libparser_unit *next;
+	for (; unit; unit = next) {
+		next = unnest_unit(unit);
+		unit->next = ctx->cache;
+		ctx->cache = unit;
+		ctx->units -= 1;
 	}
 }
 
@@ -35,26 +222,98 @@ dealloc_unit(struct libparser_unit *unit)
 {
 	struct libparser_unit *next;
 	for (; unit; unit = next) {
-		dealloc_unit(unit->in);
-		next = unit->next;
+		next = unnest_unit(unit);
 		free(unit);
 	}
 }
 
 
+static void *
+default_allocate(void *user, size_t size)
+{
+	(void) user;
+	return malloc(size);
+}
+
+
+static void
+default_deallocate(void *user, void *ptr, size_t size)
+{
+	(void) user;
+	(void) size;
+	free(ptr);
+}
+
+
+static const struct libparser_allocator default_allocator = {
+	.allocate = &default_allocate,
+	.deallocate = &default_deallocate,
+	.user = NULL
+};
+
+
 static struct libparser_unit *
-try_match(const char *rule, const union libparser_sentence *sentence, struct context *ctx)
+arena_alloc_unit(struct libparser_tree *tree)
 {
-	struct libparser_unit *unit, *next;
-	struct libparser_unit **head;
-	unsigned char c;
-	size_t i;
+	struct arena_block *block;
+	size_t size;
+
+	if (tree->free_units == tree->end_units) {
+		size = offsetof(struct arena_block, units) + tree->block_units * sizeof(*block->units);
+		block = tree->allocator.allocate(tree->allocator.user, size);
+		if (!block)
+			return NULL;
+		block->next = tree->blocks;
+		block->size = size;
+		tree->blocks = block;
+		tree->free_units = block->units;
+		tree->end_units = &block->units[tree->block_units];
+		if (tree->block_units < ARENA_MAX_BLOCK_UNITS)
+			tree->block_units *= 2;
+	}
 
+	return tree->free_units++;
+}
+
+
+/* Stop parsing because a limit in struct libparser_options was reached */
+static void
+reach_limit(struct context *ctx, int error)
+{
+	ctx->done = 1;
+	ctx->limited = 1;
+	ctx->error = error;
+}
+
+
+/* Set errno for a parse that failed, and get the value the parse function shall return */
+static int
+parse_failure(struct context *ctx)
+{
+	errno = ctx->error;
+	return ctx->limited ? LIBPARSER_LIMIT_REACHED : -1;
+}
+
+
+static struct libparser_unit *
+alloc_unit(struct context *ctx)
+{
+	struct libparser_unit *unit;
+	if (ctx->max_units && ctx->units == ctx->max_units) {
+		reach_limit(ctx, ENOMEM);
+		return NULL;
+	}
 	if (!ctx->cache) {
-		unit = calloc(1, sizeof(*unit));
+		if (ctx->tree) {
+			unit = arena_alloc_unit(ctx->tree);
+			if (unit)
+				unit->in = unit->next = NULL;
+		} else {
+			unit = calloc(1, sizeof(*unit));
+		}
 		if (!unit) {
 			ctx->done = 1;
-			ctx->error = 1;
+			ctx->error = errno ? errno : ENOMEM;
 			return NULL;
 		}
 	} else {
@@ -62,179 +321,2282 @@ try_match(const char *rule, const union libparser_sentence *sentence, struct con
 		ctx->cache = unit->next;
 		unit->in = unit->next = NULL;
 	}
+	ctx->units += 1;
+	return unit;
+}
 
-	unit->rule = rule;
-	unit->start = ctx->position;
 
-	switch (sentence->type) {
-	case LIBPARSER_SENTENCE_TYPE_CONCATENATION:
-		unit->in = try_match(NULL, sentence->binary.left, ctx);
-		if (!unit->in)
-			goto mismatch;
-		if (ctx->done)
+static struct libparser_unit *
+copy_unit(const struct libparser_unit *unit, struct context *ctx, size_t *countp)
+{
+	struct libparser_unit *ret = NULL, **head = &ret;
+	struct copy_frame *new;
+	size_t depth = 0, size;
+
+	for (;;) {
+		if (!unit) {
+			if (!depth)
+				break;
+			depth -= 1;
+			unit = ctx->copies[depth].unit;
+			head = ctx->copies[depth].head;
+		}
+		*head = alloc_unit(ctx);
+		if (!*head)
 			break;
-		unit->in->next = try_match(NULL, sentence->binary.right, ctx);
-		if (!unit->in->next) {
-			free_unit(unit->in, ctx);
-			goto mismatch;
+		(*head)->rule = unit->rule;
+		(*head)->start = unit->start;
+		(*head)->end = unit->end;
+		*countp += 1;
+		if (unit->in && unit->next) {
+			if (depth == ctx->copies_size) {
+				size = ctx->copies_size ? ctx->copies_size * 2 : 16;
+				new = realloc(ctx->copies, size * sizeof(*new));
+				if (!new) {
+					ctx->done = 1;
+					ctx->error = errno;
+					break;
+				}
+				ctx->copies = new;
+				ctx->copies_size = size;
+			}
+			ctx->copies[depth].unit = unit->next;
+			ctx->copies[depth++].head = &(*head)->next;
 		}
-		if (!unit->in->next->rule || unit->in->next->rule[0] == '_') {
-			unit->in->next->next = ctx->cache;
-			ctx->cache = unit->in->next;
-			unit->in->next = unit->in->next->in;
+		if (unit->in) {
+			head = &(*head)->in;
+			unit = unit->in;
+		} else {
+			head = &(*head)->next;
+			unit = unit->next;
 		}
-		if (!unit->in->rule || unit->in->rule[0] == '_') {
-			next = unit->in->next;
-			unit->in->next = ctx->cache;
-			ctx->cache = unit->in;
-			unit->in = unit->in->in;
-			if (unit->in) {
-				for (head = &unit->in->next; *head; head = &(*head)->next);
-				*head = next;
-			} else {
-				unit->in = next;
+	}
+
+	return ret;
+}
+
+
+static size_t
+memo_hash(const struct libparser_rule *rule, size_t position)
+{
+	size_t h = (size_t)((uintptr_t)rule >> 3);
+	h ^= position + (size_t)0x9E3779B9UL + (h << 6) + (h >> 2);
+	return h * (size_t)0x9E3779B1UL;
+}
+
+
+/* .rule of units left behind by memo_take */
+static const char taken_rule[] = "";
+
+
+static struct memo_entry *
+memo_lookup(struct memo *memo, const struct libparser_rule *rule, size_t position)
+{
+	struct memo_entry *entry = NULL;
+	struct libparser_unit *unit;
+	if (memo->size)
+		for (entry = memo->buckets[position & (memo->size - 1)]; entry; entry = entry->next)
+			if (entry->rule == rule && entry->position == position)
+				break;
+	/* the units may have been taken for another result they were in, in
+	 * which case the result is forgotten, as the rule is matched again */
+	if (entry && entry->end != position)
+		for (unit = entry->unit; unit; unit = unit == entry->last ? NULL : unit->next)
+			if (unit->rule == taken_rule)
+				return NULL;
+	return entry;
+}
+
+
+static int
+memo_grow(struct memo *memo)
+{
+	struct memo_entry **new, *entry, *next;
+	struct memo_block *block;
+	size_t i, size, count;
+
+	if (memo->count >= memo->size) {
+		size = memo->size ? memo->size * 2 : 64;
+		if (memo->limit && size * sizeof(*new) > memo->limit - (memo->used - memo->size * sizeof(*new)))
+			return -1;
+		new = calloc(size, sizeof(*new));
+		if (!new)
+			return -1;
+		for (i = 0; i < memo->size; i++) {
+			for (entry = memo->buckets[i]; entry; entry = next) {
+				next = entry->next;
+				if (entry->position < memo->floor) {
+					/* results that cannot be used after a cut are dropped rather than moved */
+					entry->next = memo->unused;
+					memo->unused = entry;
+					memo->count -= 1;
+				} else {
+					entry->next = new[entry->position & (size - 1)];
+					new[entry->position & (size - 1)] = entry;
+				}
 			}
 		}
-		break;
+		free(memo->buckets);
+		memo->used += (size - memo->size) * sizeof(*new);
+		memo->buckets = new;
+		memo->size = size;
+	}
 
-	case LIBPARSER_SENTENCE_TYPE_ALTERNATION:
-		unit->in = try_match(NULL, sentence->binary.left, ctx);
-		if (!unit->in) {
-			unit->in = try_match(NULL, sentence->binary.right, ctx);
-			if (!unit->in)
-				goto mismatch;
+	if (!memo->unused && (!memo->blocks || memo->blocks->used == memo->blocks->count)) {
+		count = memo->count > 64 ? memo->count : 64;
+		if (memo->limit && offsetof(struct memo_block, entries) + count * sizeof(*entry) > memo->limit - memo->used) {
+			if (memo->limit - memo->used < offsetof(struct memo_block, entries) + sizeof(*entry))
+				return -1;
+			count = (memo->limit - memo->used - offsetof(struct memo_block, entries)) / sizeof(*entry);
 		}
-	prone:
-		if (unit->in && (!unit->in->rule || unit->in->rule[0] == '_')) {
-			unit->in->next = ctx->cache;
-			ctx->cache = unit->in;
-			unit->in = unit->in->in;
+		block = malloc(offsetof(struct memo_block, entries) + count * sizeof(*entry));
+		if (!block)
+			return -1;
+		block->next = memo->blocks;
+		block->count = count;
+		block->used = 0;
+		memo->blocks = block;
+		memo->used += offsetof(struct memo_block, entries) + count * sizeof(*entry);
+	}
+	return 0;
+}
+
+
+/* Copy the units from first to last, but not what follows last */
+static struct libparser_unit *
+copy_units(const struct libparser_unit *first, const struct libparser_unit *last,
+           struct context *ctx, struct libparser_unit **lastp)
+{
+	struct libparser_unit *ret = NULL, **head = &ret, unit;
+	size_t count = 0;
+
+	*lastp = NULL;
+	for (; first; first = first == last ? NULL : first->next) {
+		unit = *first;
+		unit.next = NULL;
+		*head = copy_unit(&unit, ctx, &count);
+		if (!*head)
+			break;
+		*lastp = *head;
+		head = &(*head)->next;
+	}
+	return ret;
+}
+
+
+/* Remember the result of a rule, unit being the unit of the rule, which
+ * is hidden if its units are to be spliced (last then being the last of
+ * them), or NULL if it did not match; the units are not copied, instead
+ * they are kept by the memo if they are backtracked over, except for an
+ * empty match, which may be reused while it is still in use */
+static void
+memo_store(struct context *ctx, const struct libparser_rule *rule, size_t position,
+           struct libparser_unit *unit, struct libparser_unit *last)
+{
+	struct memo *memo = ctx->memo;
+	struct memo_entry *entry;
+	struct libparser_unit *first = NULL;
+
+	if (memo->full)
+		return;
+	if (unit) {
+		if (!unit->rule || unit->rule[0] == '_')
+			first = unit->in;
+		else
+			first = last = unit;
+		if (first && unit->end == position) {
+			first = copy_units(first, last, ctx, &last);
+			if (ctx->error) {
+				free_unit(first, ctx);
+				return;
+			}
+			last->next = memo->orphans;
+			memo->orphans = first;
+		}
+	}
+	if (memo->count >= memo->size || (!memo->unused && memo->blocks->used == memo->blocks->count)) {
+		if (memo_grow(memo)) {
+			memo->full = 1;
+			return;
 		}
-		break;
+	}
 
-	case LIBPARSER_SENTENCE_TYPE_REJECTION:
-		unit->in = try_match(NULL, sentence->unary.sentence, ctx);
-		if (unit->in) {
-			free_unit(unit->in, ctx);
-			if (!ctx->exception)
-				goto mismatch;
-			ctx->exception = 0;
+	if (memo->unused) {
+		entry = memo->unused;
+		memo->unused = entry->next;
+	} else {
+		entry = &memo->blocks->entries[memo->blocks->used++];
+	}
+	entry->next = memo->buckets[position & (memo->size - 1)];
+	memo->buckets[position & (memo->size - 1)] = entry;
+
+	entry->matched = !!unit;
+	entry->unit = first;
+	entry->last = first ? last : NULL;
+	if (unit) {
+		entry->end = unit->end;
+		memo->stored += 1;
+	}
+	entry->rule = rule;
+	entry->position = position;
+	memo->count += 1;
+}
+
+
+/* Get the units of a remembered match; a match that is not empty can only
+ * be reused once it has been backtracked over, so its units are moved out
+ * of the memo, leaving their husks behind, but an empty match is copied */
+static struct libparser_unit *
+memo_take(struct memo_entry *entry, struct context *ctx, struct libparser_unit **lastp)
+{
+	struct libparser_unit *ret = NULL, **head = &ret, *unit, *next;
+
+	if (entry->end == entry->position)
+		return copy_units(entry->unit, entry->last, ctx, lastp);
+
+	*lastp = NULL;
+	for (unit = entry->unit; unit; unit = next) {
+		next = unit == entry->last ? NULL : unit->next;
+		*head = alloc_unit(ctx);
+		if (!*head)
+			break;
+		**head = *unit;
+		(*head)->next = NULL;
+		unit->rule = taken_rule;
+		unit->in = NULL;
+		*lastp = *head;
+		head = &(*head)->next;
+	}
+
+	entry->unit = ret;
+	entry->last = *lastp;
+	ctx->memo->stored += 1;
+	return ret;
+}
+
+
+/* Forget all results but keep the table, and the largest block of entries, allocated */
+static void
+memo_clear(struct memo *memo, struct context *ctx)
+{
+	struct memo_block *block;
+	if (memo->size)
+		memset(memo->buckets, 0, memo->size * sizeof(*memo->buckets));
+	if (memo->blocks) {
+		while ((block = memo->blocks->next)) {
+			memo->blocks->next = block->next;
+			memo->used -= offsetof(struct memo_block, entries) + block->count * sizeof(*block->entries);
+			free(block);
 		}
-		ctx->position = unit->start;
-		unit->rule = NULL;
-		break;
+		memo->blocks->used = 0;
+	}
+	memo->unused = NULL;
+	free_unit(memo->orphans, ctx);
+	memo->orphans = NULL;
+	memo->count = 0;
+	memo->floor = 0;
+	memo->full = 0;
+}
 
-	case LIBPARSER_SENTENCE_TYPE_OPTIONAL:
-		unit->in = try_match(NULL, sentence->unary.sentence, ctx);
-		goto prone;
 
-	case LIBPARSER_SENTENCE_TYPE_REPEATED:
-		head = &unit->in;
-		while ((*head = try_match(NULL, sentence->unary.sentence, ctx))) {
-			if (!(*head)->rule || (*head)->rule[0] == '_') {
-				(*head)->next = ctx->cache;
-				ctx->cache = *head;
-				*head = (*head)->in;
-				while (*head)
-					head = &(*head)->next;
-			} else {
-				head = &(*head)->next;
-			}
-			if (ctx->done)
-				break;
+static void
+memo_destroy(struct memo *memo, struct context *ctx)
+{
+	struct memo_block *block;
+	memo_clear(memo, ctx);
+	while ((block = memo->blocks)) {
+		memo->blocks = block->next;
+		free(block);
+	}
+	free(memo->buckets);
+}
+
+
+static const struct libparser_rule *
+find_rule(const struct libparser_rule *const *rules, const char *name)
+{
+	for (; *rules; rules++)
+		if (!strcmp((*rules)->name, name))
+			return *rules;
+	abort();
+}
+
+
+static int
+can_begin(const struct libparser_first_set *first, const struct context *ctx)
+{
+	unsigned char c;
+	if (!first || first->nullable || ctx->tokens)
+		return 1;
+	if (ctx->position == ctx->length)
+		return !ctx->final;
+	c = *CURRENT(ctx);
+	return (first->bytes[c >> 3] >> (c & 7)) & 1;
+}
+
+
+static void
+init_byte_class(struct byte_class *class, const void *key, const unsigned char set[32])
+{
+	unsigned c, low;
+
+	class->key = key;
+	memcpy(class->set, set, sizeof(class->set));
+
+	class->nranges = 0;
+	for (c = 0; c < 256;) {
+		if (!IN_SET(set, c)) {
+			c++;
+			continue;
+		}
+		for (low = c; c < 256 && IN_SET(set, c); c++);
+		if (class->nranges == SCAN_MAX_RANGES) {
+			class->nranges = 0;
+			break;
 		}
-		break;
+		class->low[class->nranges] = (unsigned char)low;
+		class->width[class->nranges] = (unsigned char)(c - 1 - low);
+		class->nranges += 1;
+	}
 
-	case LIBPARSER_SENTENCE_TYPE_STRING:
-		if (sentence->string.length > ctx->length - ctx->position)
-			goto mismatch;
-		if (memcmp(&ctx->data[ctx->position], sentence->string.string, sentence->string.length))
-			goto mismatch;
-		ctx->position += sentence->string.length;
-		break;
+	memset(class->truffle_low, 0, sizeof(class->truffle_low));
+	memset(class->truffle_high, 0, sizeof(class->truffle_high));
+	for (c = 0; c < 256; c++) {
+		if (!IN_SET(set, c))
+			continue;
+		if (c < 128)
+			class->truffle_low[c & 15] |= (unsigned char)(1 << (c >> 4));
+		else
+			class->truffle_high[c & 15] |= (unsigned char)(1 << ((c >> 4) & 7));
+	}
+}
 
-	case LIBPARSER_SENTENCE_TYPE_CHAR_RANGE:
-		if (ctx->position == ctx->length)
-			goto mismatch;
-		c = ((const unsigned char *)ctx->data)[ctx->position];
-		if (sentence->char_range.low > c || c > sentence->char_range.high)
-			goto mismatch;
-		ctx->position += 1;
-		break;
 
-	case LIBPARSER_SENTENCE_TYPE_RULE:
-		for (i = 0; ctx->rules[i]; i++)
-			if (!strcmp(ctx->rules[i]->name, sentence->rule.rule))
-				break;
-		if (!ctx->rules[i])
-			abort();
-		unit->in = try_match(ctx->rules[i]->name, ctx->rules[i]->sentence, ctx);
-		if (!unit->in)
-			goto mismatch;
-		goto prone;
+static size_t
+scan_scalar(const struct byte_class *class, const unsigned char *s, size_t n)
+{
+	size_t i;
+	for (i = 0; i < n && IN_SET(class->set, s[i]); i++);
+	return i;
+}
 
-	case LIBPARSER_SENTENCE_TYPE_EXCEPTION:
-		ctx->done = 1;
-		ctx->exception = 1;
-		break;
 
-	case LIBPARSER_SENTENCE_TYPE_EOF:
-		if (ctx->position != ctx->length)
-			goto mismatch;
-		ctx->done = 1;
-		break;
+#ifdef HAVE_X86_SIMD
 
-	default:
-		abort();
+static size_t
+scan_sse2(const struct byte_class *class, const unsigned char *s, size_t n)
+{
+	__m128i low[SCAN_MAX_RANGES], width[SCAN_MAX_RANGES], zero = _mm_setzero_si128(), v, in;
+	size_t i;
+	unsigned j, mask;
+
+	for (j = 0; j < class->nranges; j++) {
+		low[j] = _mm_set1_epi8((char)class->low[j]);
+		width[j] = _mm_set1_epi8((char)class->width[j]);
 	}
 
-	unit->end = ctx->position;
-	return unit;
+	for (i = 0; i + 16 <= n; i += 16) {
+		v = _mm_loadu_si128((const void *)&s[i]);
+		in = zero;
+		/* c is in [low, low + width] iff (c - low) mod 256 saturatingly minus width is 0 */
+		for (j = 0; j < class->nranges; j++)
+			in = _mm_or_si128(in, _mm_cmpeq_epi8(_mm_subs_epu8(_mm_sub_epi8(v, low[j]), width[j]), zero));
+		mask = (unsigned)_mm_movemask_epi8(in);
+		if (mask != 0xFFFFU)
+			return i + (size_t)__builtin_ctz(~mask);
+	}
 
-mismatch:
-	ctx->position = unit->start;
-	unit->next = ctx->cache;
-	ctx->cache = unit;
-	return NULL;
+	return i + scan_scalar(class, &s[i], n - i);
 }
 
 
-int
-libparser_parse_file(const struct libparser_rule *const rules[], const char *data, size_t length, struct libparser_unit **rootp)
+__attribute__((target("avx2")))
+static size_t
+scan_avx2(const struct byte_class *class, const unsigned char *s, size_t n)
 {
-	struct libparser_unit *ret, *t;
-	struct context ctx;
+	__m256i tlow, thigh, bits, nibble, top, v, t, b;
 	size_t i;
+	unsigned mask;
 
-	ctx.rules = rules;
-	ctx.cache = NULL;
-	ctx.data = data;
-	ctx.length = length;
-	ctx.position = 0;
-	ctx.done = 0;
-	ctx.error = 0;
-	ctx.exception = 0;
+	tlow = _mm256_broadcastsi128_si256(_mm_loadu_si128((const void *)class->truffle_low));
+	thigh = _mm256_broadcastsi128_si256(_mm_loadu_si128((const void *)class->truffle_high));
+	bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+	                        1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+	nibble = _mm256_set1_epi8(0x0F);
+	top = _mm256_set1_epi8(-128);
 
-	for (i = 0; rules[i]; i++)
-		if (!strcmp(rules[i]->name, "@start"))
-			break;
-	if (!rules[i])
-		abort();
+	for (i = 0; i + 32 <= n; i += 32) {
+		v = _mm256_loadu_si256((const void *)&s[i]);
+		/* vpshufb yields 0 for lanes with the high bit set, so each table only covers its half */
+		t = _mm256_or_si256(_mm256_shuffle_epi8(tlow, v), _mm256_shuffle_epi8(thigh, _mm256_xor_si256(v, top)));
+		b = _mm256_shuffle_epi8(bits, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+		mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(t, b), _mm256_setzero_si256()));
+		if (mask)
+			return i + (size_t)__builtin_ctz(mask);
+	}
+
+	return i + scan_scalar(class, &s[i], n - i);
+}
 
-	ret = try_match(rules[i]->name, rules[i]->sentence, &ctx);
+#endif
 
-	while (ctx.cache) {
-		t = ctx.cache;
-		ctx.cache = t->next;
-		free(t);
+
+static size_t
+scan_class(struct context *ctx, const void *key, const unsigned char set[32], const unsigned char *s, size_t n)
+{
+	struct byte_class *class;
+	size_t i;
+
+	for (i = 0; i < n && i < SCAN_SCALAR_PREFIX; i++)
+		if (!IN_SET(set, s[i]))
+			return i;
+	if (i == n)
+		return i;
+
+	class = &ctx->classes[((uintptr_t)key >> 4) % SCAN_CACHE_SIZE];
+	if (class->key != key)
+		init_byte_class(class, key, set);
+
+#ifdef HAVE_X86_SIMD
+	if (__builtin_cpu_supports("avx2"))
+		return i + scan_avx2(class, &s[i], n - i);
+	if (class->nranges)
+		return i + scan_sse2(class, &s[i], n - i);
+#endif
+	return i + scan_scalar(class, &s[i], n - i);
+}
+
+
+static void
+get_byte_set(const union libparser_sentence *sentence, unsigned char set[32])
+{
+	unsigned c;
+	if (sentence->type == LIBPARSER_SENTENCE_TYPE_CHAR_SET) {
+		memcpy(set, sentence->char_set.set, 32);
+	} else {
+		memset(set, 0, 32);
+		for (c = sentence->char_range.low; c <= sentence->char_range.high; c++)
+			set[c >> 3] |= (unsigned char)(1 << (c & 7));
 	}
+}
 
-	if (ctx.error) {
-		dealloc_unit(ret);
-		*rootp = NULL;
-		return -1;
+
+/* Match {class} or {!"string", class} without iterating over each byte,
+ * returns 1 on success, 0 if not applicable, and -1 if more input is
+ * required (after matching as much as possible) */
+static int
+scan_repeated(const union libparser_sentence *repeated, struct context *ctx)
+{
+	const union libparser_sentence *sentence = repeated->unary.sentence, *stop = NULL;
+	const unsigned char *s;
+	size_t i = 0, n = ctx->length - ctx->position;
+	unsigned char set[32], c;
+	int in_class;
+
+	if (ctx->tokens)
+		return 0;
+	s = CURRENT(ctx);
+
+	if (sentence->type == LIBPARSER_SENTENCE_TYPE_CONCATENATION &&
+	    sentence->binary.left->type == LIBPARSER_SENTENCE_TYPE_REJECTION &&
+	    sentence->binary.left->unary.sentence->type == LIBPARSER_SENTENCE_TYPE_STRING) {
+		stop = sentence->binary.left->unary.sentence;
+		sentence = sentence->binary.right;
 	}
+	if (sentence->type != LIBPARSER_SENTENCE_TYPE_CHAR_SET && sentence->type != LIBPARSER_SENTENCE_TYPE_CHAR_RANGE)
+		return 0;
 
-	*rootp = ret;
-	return !ctx.exception;
+	get_byte_set(sentence, set);
+	if (!stop) {
+		i = scan_class(ctx, repeated, set, s, n);
+		ctx->position += i;
+		return i == n && !ctx->final ? -1 : 1;
+	}
+
+	if (!stop->string.length)
+		return 1;
+	c = (unsigned char)stop->string.string[0];
+	in_class = IN_SET(set, c);
+	set[c >> 3] &= (unsigned char)~(1 << (c & 7));
+	for (;;) {
+		i += scan_class(ctx, repeated, set, &s[i], n - i);
+		if (i == n || s[i] != c || !in_class)
+			break;
+		if (stop->string.length > n - i) {
+			if (!ctx->final && !memcmp(&s[i], stop->string.string, n - i))
+				break;
+		} else if (!memcmp(&s[i], stop->string.string, stop->string.length)) {
+			break;
+		}
+		i += 1;
+	}
+	ctx->position += i;
+	if (!ctx->final && (i == n || (in_class && s[i] == c && stop->string.length > n - i)))
+		return -1;
+	return 1;
+}
+
+
+/* Commit to the frames being matched, so that parsing
+ * stops rather than backtracks if any of them fails */
+static void
+cut(struct context *ctx)
+{
+	size_t i, rules;
+
+	ctx->cut_depth = ctx->depth - 1;
+	if (ctx->memo)
+		ctx->memo->floor = ctx->position;
+
+	ctx->events_base = ctx->nevents;
+	/* the frames that could have backtracked over the profiled matches cannot fail anymore */
+	ctx->nprofiled = 0;
+
+	/* units of a repetition in the main rule that cannot fail can be handed to the callback */
+	if (ctx->callback) {
+		for (i = 0, rules = 0; i < ctx->cut_depth && i < ctx->stream_depth && rules < 2; i++) {
+			if (ctx->frames[i].state == FRAME_REPEATED) {
+				ctx->stream_depth = i;
+				break;
+			}
+			rules += ctx->frames[i].state == FRAME_RULE;
+		}
+	}
+}
+
+
+/* Whether a sentence may fail to match, only looking
+ * through max_rules levels of rule references */
+static int
+can_fail(const union libparser_sentence *sentence, const struct context *ctx, int max_rules)
+{
+	const struct libparser_rule *target;
+	size_t i;
+
+	switch (sentence->type) {
+	case LIBPARSER_SENTENCE_TYPE_CONCATENATION:
+		return can_fail(sentence->binary.left, ctx, max_rules) || can_fail(sentence->binary.right, ctx, max_rules);
+	case LIBPARSER_SENTENCE_TYPE_ALTERNATION:
+		return can_fail(sentence->binary.left, ctx, max_rules) && can_fail(sentence->binary.right, ctx, max_rules);
+	case LIBPARSER_SENTENCE_TYPE_SEQUENCE:
+		for (i = 0; i < sentence->nary.count; i++)
+			if (can_fail(sentence->nary.sentences[i], ctx, max_rules))
+				return 1;
+		return 0;
+	case LIBPARSER_SENTENCE_TYPE_CHOICE:
+		for (i = 0; i < sentence->nary.count; i++)
+			if (!can_fail(sentence->nary.sentences[i], ctx, max_rules))
+				return 0;
+		return 1;
+	case LIBPARSER_SENTENCE_TYPE_OPTIONAL:
+	case LIBPARSER_SENTENCE_TYPE_REPEATED:
+	case LIBPARSER_SENTENCE_TYPE_EXCEPTION:
+	case LIBPARSER_SENTENCE_TYPE_CUT:
+		return 0;
+	case LIBPARSER_SENTENCE_TYPE_RULE:
+		if (!max_rules)
+			return 1;
+		target = sentence->rule.target;
+		if (!target)
+			target = find_rule(ctx->rules, sentence->rule.rule);
+		return can_fail(target->sentence, ctx, max_rules - 1);
+	default:
+		return 1;
+	}
+}
+
+
+/* Hand the units matched so far by a repetition, that
+ * can no longer be backtracked over, to the callback */
+static void
+deliver_units(struct context *ctx, struct frame *frame)
+{
+	struct libparser_unit *unit = frame->unit->in, *next;
+
+	frame->unit->in = NULL;
+	frame->last = NULL;
+
+	for (; unit; unit = next) {
+		next = unit->next;
+		unit->next = NULL;
+		ctx->callback(unit, &ctx->data[unit->start - ctx->offset], ctx->user);
+		free_unit(unit, ctx);
+	}
+}
+
+
+/* Copy an embedded unit out of its frame, so it can be kept */
+static struct libparser_unit *
+detach_unit(struct libparser_unit *unit, struct context *ctx)
+{
+	struct libparser_unit *copy = alloc_unit(ctx);
+	if (!copy) {
+		free_unit(unit->in, ctx);
+		return NULL;
+	}
+	*copy = *unit;
+	return copy;
+}
+
+
+static struct libparser_unit *
+last_unit(struct libparser_unit *unit)
+{
+	if (unit)
+		while (unit->next)
+			unit = unit->next;
+	return unit;
+}
+
+
+/* Put back the units of a frame that has failed, unless results remembered
+ * since the frame was entered may be among them, in which case they are
+ * kept, so that the results can be reused rather than matched again */
+static void
+discard_units(struct context *ctx, struct frame *frame)
+{
+	struct libparser_unit *units = frame->unit->in;
+	struct memo *memo = ctx->memo;
+
+	frame->unit->in = NULL;
+	if (!units || !memo || !memo->count || memo->stored == frame->memoised) {
+		free_unit(units, ctx);
+		return;
+	}
+	last_unit(units)->next = memo->orphans;
+	memo->orphans = units;
+}
+
+
+/* Append a matched unit, or its children if it is hidden, to
+ * the units of a frame, last is the last unit in ret->in */
+static void
+append_units(struct frame *frame, struct libparser_unit *ret, struct libparser_unit *last)
+{
+	struct libparser_unit *first;
+
+	if (!ret->rule || ret->rule[0] == '_') {
+		first = ret->in;
+	} else {
+		first = last = ret;
+	}
+	if (first) {
+		if (frame->last)
+			frame->last->next = first;
+		else
+			frame->unit->in = first;
+		frame->last = last;
+	}
+}
+
+
+/* Wrap the units of a sequence that stops at an exception in an anonymous
+ * unit for each remaining link, as a chain of concatenations would have */
+static void
+wrap_stopped_sequence(struct frame *frame, struct context *ctx)
+{
+	struct libparser_unit *wrapper;
+	size_t links = frame->sentence->nary.count - 1 - (frame->index ? frame->index : 1);
+
+	while (links--) {
+		wrapper = alloc_unit(ctx);
+		if (!wrapper)
+			return;
+		wrapper->rule = NULL;
+		wrapper->start = frame->unit->start;
+		wrapper->end = ctx->position;
+		wrapper->in = frame->unit->in;
+		frame->unit->in = frame->last = wrapper;
+	}
+}
+
+
+static int
+log_event(struct context *ctx, const char *rule)
+{
+	struct event *new;
+	size_t size;
+
+	if (ctx->nevents - ctx->events_base == ctx->log_size) {
+		size = ctx->log_size ? ctx->log_size * 2 : 64;
+		new = size > SIZE_MAX / sizeof(*new) ? NULL : realloc(ctx->log, size * sizeof(*new));
+		if (!new) {
+			ctx->done = 1;
+			ctx->error = ENOMEM;
+			return 0;
+		}
+		ctx->log = new;
+		ctx->log_size = size;
+	}
+	ctx->log[ctx->nevents - ctx->events_base].rule = rule;
+	ctx->log[ctx->nevents - ctx->events_base].start = ctx->position;
+	ctx->nevents += 1;
+	if (ctx->events->enter)
+		ctx->events->enter(rule, ctx->position, ctx->events->user);
+	return 1;
+}
+
+
+/* Retract the rules entered after the first count events, latest first */
+static void
+retract_events(struct context *ctx, size_t count)
+{
+	struct event *event;
+
+	if (count < ctx->events_base)
+		count = ctx->events_base;
+	while (ctx->nevents > count) {
+		ctx->nevents -= 1;
+		event = &ctx->log[ctx->nevents - ctx->events_base];
+		if (ctx->events->retract)
+			ctx->events->retract(event->rule, event->start, ctx->events->user);
+	}
+}
+
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+
+static struct libparser_rule_profile *
+profile_rule(struct context *ctx, const struct libparser_rule *rule)
+{
+	struct libparser_profile *profile = ctx->profile;
+	struct libparser_rule_profile *new;
+	size_t i, j, size;
+
+	if (profile->size) {
+		for (i = memo_hash(rule, 0) & (profile->size - 1); profile->rules[i].rule; i = (i + 1) & (profile->size - 1))
+			if (profile->rules[i].rule == rule)
+				return &profile->rules[i];
+	}
+
+	if (2 * (profile->count + 1) > profile->size) {
+		size = profile->size ? profile->size * 2 : 64;
+		new = calloc(size, sizeof(*new));
+		if (!new) {
+			ctx->done = 1;
+			ctx->error = ENOMEM;
+			return NULL;
+		}
+		for (i = 0; i < profile->size; i++) {
+			if (!profile->rules[i].rule)
+				continue;
+			for (j = memo_hash(profile->rules[i].rule, 0) & (size - 1); new[j].rule; j = (j + 1) & (size - 1));
+			new[j] = profile->rules[i];
+		}
+		free(profile->rules);
+		profile->rules = new;
+		profile->size = size;
+	}
+
+	for (i = memo_hash(rule, 0) & (profile->size - 1); profile->rules[i].rule; i = (i + 1) & (profile->size - 1));
+	profile->rules[i].rule = rule;
+	profile->count += 1;
+	return &profile->rules[i];
+}
+
+
+static int
+profile_enter(struct context *ctx, struct frame *frame)
+{
+	struct libparser_rule_profile *entry;
+
+	entry = profile_rule(ctx, frame->target);
+	if (!entry)
+		return 0;
+	entry->invocations += 1;
+	frame->began = now();
+	return 1;
+}
+
+
+static void
+profile_leave(struct context *ctx, struct frame *frame, int matched)
+{
+	struct libparser_rule_profile *entry;
+	struct profiled *new;
+	size_t size;
+
+	entry = profile_rule(ctx, frame->target);
+	if (!entry)
+		return;
+	entry->nanoseconds += now() - frame->began;
+	if (!matched) {
+		entry->failures += 1;
+		return;
+	}
+	entry->matches += 1;
+
+	/* remember the match, so that it can be accounted for if it is backtracked over */
+	if (ctx->nprofiled == ctx->profiled_size) {
+		size = ctx->profiled_size ? ctx->profiled_size * 2 : 64;
+		new = size > SIZE_MAX / sizeof(*new) ? NULL : realloc(ctx->profiled, size * sizeof(*new));
+		if (!new) {
+			ctx->done = 1;
+			ctx->error = ENOMEM;
+			return;
+		}
+		ctx->profiled = new;
+		ctx->profiled_size = size;
+	}
+	ctx->profiled[ctx->nprofiled].rule = frame->target;
+	ctx->profiled[ctx->nprofiled].length = ctx->position - frame->unit->start;
+	ctx->nprofiled += 1;
+}
+
+
+/* Account for the rules matched after the first count profiled matches, as they are backtracked over */
+static void
+discard_profiled(struct context *ctx, size_t count)
+{
+	struct libparser_rule_profile *entry;
+
+	while (ctx->nprofiled > count) {
+		ctx->nprofiled -= 1;
+		entry = profile_rule(ctx, ctx->profiled[ctx->nprofiled].rule);
+		if (entry)
+			entry->backtracked += ctx->profiled[ctx->nprofiled].length;
+	}
+}
+
+
+static int
+push_frame(struct context *ctx, const char *rule, const union libparser_sentence *sentence)
+{
+	struct frame *new, *frame;
+	struct libparser_unit *unit;
+	size_t size, i;
+
+	if (ctx->max_depth && ctx->depth == ctx->max_depth) {
+		reach_limit(ctx, ELOOP);
+		return 0;
+	}
+	if (ctx->max_steps && ctx->steps == ctx->max_steps) {
+		reach_limit(ctx, ETIMEDOUT);
+		return 0;
+	}
+	ctx->steps += 1;
+	if (ctx->depth == ctx->frames_size) {
+		size = ctx->frames_size ? ctx->frames_size * 2 : 64;
+		if (size > SIZE_MAX / sizeof(*new)) {
+			new = NULL;
+			errno = ENOMEM;
+		} else {
+			new = realloc(ctx->frames, size * sizeof(*new));
+		}
+		if (!new) {
+			ctx->done = 1;
+			ctx->error = errno;
+			return 0;
+		}
+		ctx->frames = new;
+		ctx->frames_size = size;
+		for (i = 0; i < ctx->depth; i++)
+			if (new[i].embedded)
+				new[i].unit = &new[i].self;
+	}
+
+	frame = &ctx->frames[ctx->depth];
+	frame->events = ctx->nevents;
+	frame->profiled = ctx->nprofiled;
+	frame->embedded = !rule || rule[0] == '_' || ctx->depth >= ctx->recognise_depth || ctx->events;
+	if (ctx->events && !(!rule || rule[0] == '_' || ctx->depth >= ctx->recognise_depth) && !log_event(ctx, rule))
+		return 0;
+	if (frame->embedded) {
+		/* hidden units are spliced into their parent as soon as they
+		 * have been matched, so they need not be allocated */
+		unit = &frame->self;
+		unit->in = unit->next = NULL;
+	} else {
+		unit = alloc_unit(ctx);
+		if (!unit)
+			return 0;
+	}
+	unit->rule = rule;
+	unit->start = ctx->position;
+
+	frame->sentence = sentence;
+	frame->unit = unit;
+	frame->last = NULL;
+	frame->state = FRAME_ENTER;
+	frame->memoised = ctx->memo ? ctx->memo->stored : 0;
+	frame->safe = 0;
+	if (ctx->callback || ctx->events) {
+		if (!ctx->depth) {
+			frame->safe = 1;
+		} else if (frame[-1].safe) {
+			switch (frame[-1].state) {
+			case FRAME_CONCATENATION_LEFT:
+				frame->safe = !can_fail(frame[-1].sentence->binary.right, ctx, CAN_FAIL_MAX_RULES);
+				break;
+			case FRAME_SEQUENCE:
+				frame->safe = 1;
+				for (i = frame[-1].index + 1; frame->safe && i < frame[-1].sentence->nary.count; i++)
+					frame->safe = !can_fail(frame[-1].sentence->nary.sentences[i], ctx, CAN_FAIL_MAX_RULES);
+				break;
+			case FRAME_REJECTION:
+				break;
+			case FRAME_RULE:
+				/* only units of the main rule are handed to the callback,
+				 * never units of a rule it uses that is still being matched */
+				frame->safe = 1;
+				for (i = 0; ctx->callback && i + 1 < ctx->depth; i++)
+					if (ctx->frames[i].state == FRAME_RULE)
+						frame->safe = 0;
+				break;
+			default:
+				frame->safe = 1;
+				break;
+			}
+		}
+		if (frame->safe && sentence->type == LIBPARSER_SENTENCE_TYPE_REPEATED && ctx->stream_depth == NO_FRAME)
+			ctx->stream_depth = ctx->depth;
+	}
+	ctx->depth += 1;
+	return 1;
+}
+
+
+/* Suspend the current frame and match SENTENCE, the result is
+ * in ret when the frame is resumed at STATE (NULL on failure) */
+#define CALL(RULE, SENTENCE, STATE)\
+	do {\
+		frame->state = (STATE);\
+		ret = NULL;\
+		push_frame(ctx, (RULE), (SENTENCE));\
+		goto next;\
+	} while (0)
+
+
+/* Run the frames above base until they have been matched, or
+ * until more input is required, in which case ctx->depth > base */
+static struct libparser_unit *
+run_frames(struct context *ctx, size_t base)
+{
+	const union libparser_sentence *sentence;
+	const struct libparser_rule *target;
+	struct libparser_unit *unit, *ret = NULL, *last = NULL;
+	const struct libparser_string_set_node *node;
+	struct memo_entry *memoised;
+	struct frame *frame;
+	size_t best, end = 0, i, low, high, mid;
+	unsigned char c;
+	int recognising;
+
+	while (ctx->depth > base) {
+		frame = &ctx->frames[ctx->depth - 1];
+		sentence = frame->sentence;
+		unit = frame->unit;
+		/* when only recognising, ret is not a tree, only non-NULL on match,
+		 * otherwise last is the last unit in ret->in */
+		recognising = ctx->depth > ctx->recognise_depth;
+
+		switch (frame->state) {
+		case FRAME_ENTER:
+			break;
+
+		case FRAME_CONCATENATION_LEFT:
+			if (!ret)
+				goto mismatch;
+			if (recognising) {
+				if (ctx->done)
+					goto match;
+				CALL(NULL, sentence->binary.right, FRAME_CONCATENATION_RIGHT);
+			}
+			if (ctx->done) {
+				/* the left operand is not spliced when stopping at an exception */
+				if (ctx->events)
+					ret = NULL;
+				else if (!ret->rule || ret->rule[0] == '_')
+					ret = detach_unit(ret, ctx);
+				unit->in = frame->last = ret;
+				goto match;
+			}
+			/* the right operand reuses the frame of the left operand */
+			append_units(frame, ret, last);
+			CALL(NULL, sentence->binary.right, FRAME_CONCATENATION_RIGHT);
+
+		case FRAME_CONCATENATION_RIGHT:
+			if (recognising) {
+				if (!ret)
+					goto mismatch;
+				goto match;
+			}
+			if (!ret) {
+				if (ctx->depth > ctx->cut_depth)
+					discard_units(ctx, frame);
+				goto mismatch;
+			}
+			append_units(frame, ret, last);
+			goto match;
+
+		case FRAME_ALTERNATION_LEFT:
+		alternation_left:
+			unit->in = ret;
+			if (unit->in)
+				goto prone;
+			if (!can_begin(sentence->binary.right_first, ctx))
+				goto mismatch;
+			CALL(NULL, sentence->binary.right, FRAME_ALTERNATION_RIGHT);
+
+		case FRAME_ALTERNATION_RIGHT:
+			unit->in = ret;
+			if (!unit->in)
+				goto mismatch;
+			goto prone;
+
+		case FRAME_SEQUENCE:
+			if (!ret) {
+				if (recognising)
+					goto mismatch;
+				if (ctx->depth > ctx->cut_depth) {
+					discard_units(ctx, frame);
+					goto mismatch;
+				}
+				/* backtracking over a cut, stop as at an exception */
+				ctx->done = 1;
+				ctx->exception = 1;
+				goto sequence_stopped;
+			}
+			if (recognising) {
+				if (ctx->done)
+					goto match;
+			} else if (!ctx->done || frame->index) {
+				append_units(frame, ret, last);
+			} else if (ctx->events) {
+				unit->in = NULL;
+			} else {
+				/* the first operand is not spliced when stopping at an exception */
+				if (!ret->rule || ret->rule[0] == '_')
+					ret = detach_unit(ret, ctx);
+				unit->in = frame->last = ret;
+			}
+			if (ctx->done) {
+			sequence_stopped:
+				if (!ctx->events && !ctx->error)
+					wrap_stopped_sequence(frame, ctx);
+				goto match;
+			}
+			if (++frame->index == sentence->nary.count)
+				goto match;
+			CALL(NULL, sentence->nary.sentences[frame->index], FRAME_SEQUENCE);
+
+		case FRAME_CHOICE:
+			unit->in = ret;
+			if (unit->in)
+				goto prone;
+			frame->index += 1;
+		choice:
+			for (; frame->index < sentence->nary.count; frame->index++)
+				if (!sentence->nary.first || can_begin(sentence->nary.first[frame->index], ctx))
+					CALL(NULL, sentence->nary.sentences[frame->index], FRAME_CHOICE);
+			goto mismatch;
+
+		case FRAME_REJECTION:
+			ctx->rejections -= 1;
+			if (ctx->recognise_depth == ctx->depth)
+				ctx->recognise_depth = NO_FRAME;
+		rejection:
+			if (ctx->events)
+				retract_events(ctx, frame->events);
+			if (ctx->profile)
+				discard_profiled(ctx, frame->profiled);
+			if (ret) {
+				if (!ctx->exception)
+					goto mismatch;
+				ctx->exception = 0;
+			}
+			ctx->position = unit->start;
+			unit->rule = NULL;
+			goto match;
+
+		case FRAME_OPTIONAL:
+			unit->in = ret;
+			goto prone;
+
+		case FRAME_REPEATED:
+			if (recognising) {
+				if (!ret || ctx->done)
+					goto match;
+				goto repeat;
+			}
+			if (!ret)
+				goto match;
+			append_units(frame, ret, last);
+			if (ctx->depth - 1 == ctx->stream_depth) {
+				if (ctx->callback)
+					deliver_units(ctx, frame);
+				else
+					ctx->events_base = ctx->nevents;
+			}
+			if (ctx->done)
+				goto match;
+			goto repeat;
+
+		case FRAME_RULE:
+			unit->in = ret;
+			if (ctx->memo && !ctx->done && !recognising)
+				memo_store(ctx, frame->target, unit->start, unit->in, last);
+			if (!unit->in)
+				goto mismatch;
+			goto prone;
+
+		default:
+			abort();
+		}
+
+		switch (sentence->type) {
+		case LIBPARSER_SENTENCE_TYPE_CONCATENATION:
+			CALL(NULL, sentence->binary.left, FRAME_CONCATENATION_LEFT);
+
+		case LIBPARSER_SENTENCE_TYPE_ALTERNATION:
+			if (can_begin(sentence->binary.left_first, ctx))
+				CALL(NULL, sentence->binary.left, FRAME_ALTERNATION_LEFT);
+			goto alternation_left;
+
+		case LIBPARSER_SENTENCE_TYPE_SEQUENCE:
+			frame->index = 0;
+			CALL(NULL, sentence->nary.sentences[0], FRAME_SEQUENCE);
+
+		case LIBPARSER_SENTENCE_TYPE_CHOICE:
+			frame->index = 0;
+			goto choice;
+
+		case LIBPARSER_SENTENCE_TYPE_REJECTION:
+			if (can_begin(sentence->unary.first, ctx)) {
+				ctx->rejections += 1;
+				/* the operand is never kept, so it is only recognised */
+				if (ctx->recognise_depth == NO_FRAME)
+					ctx->recognise_depth = ctx->depth;
+				CALL(NULL, sentence->unary.sentence, FRAME_REJECTION);
+			}
+			goto rejection;
+
+		case LIBPARSER_SENTENCE_TYPE_OPTIONAL:
+			if (can_begin(sentence->unary.first, ctx))
+				CALL(NULL, sentence->unary.sentence, FRAME_OPTIONAL);
+			goto match;
+
+		case LIBPARSER_SENTENCE_TYPE_REPEATED:
+			switch (scan_repeated(sentence, ctx)) {
+			case 1:
+				goto match;
+			case -1:
+				goto suspend;
+			default:
+				break;
+			}
+		repeat:
+			if (!can_begin(sentence->unary.first, ctx))
+				goto match;
+			CALL(NULL, sentence->unary.sentence, FRAME_REPEATED);
+
+		case LIBPARSER_SENTENCE_TYPE_STRING:
+			if (ctx->tokens)
+				goto mismatch;
+			if (sentence->string.length > ctx->length - ctx->position) {
+				if (ctx->final || memcmp(CURRENT(ctx), sentence->string.string, ctx->length - ctx->position))
+					goto mismatch;
+				goto suspend;
+			}
+			if (memcmp(CURRENT(ctx), sentence->string.string, sentence->string.length))
+				goto mismatch;
+			ctx->position += sentence->string.length;
+			goto match;
+
+		case LIBPARSER_SENTENCE_TYPE_CHAR_RANGE:
+			if (ctx->tokens)
+				goto mismatch;
+			if (ctx->position == ctx->length)
+				goto end_of_data;
+			c = *CURRENT(ctx);
+			if (sentence->char_range.low > c || c > sentence->char_range.high)
+				goto mismatch;
+			ctx->position += 1;
+			goto match;
+
+		case LIBPARSER_SENTENCE_TYPE_CHAR_SET:
+			if (ctx->tokens)
+				goto mismatch;
+			if (ctx->position == ctx->length)
+				goto end_of_data;
+			c = *CURRENT(ctx);
+			if (!((sentence->char_set.set[c >> 3] >> (c & 7)) & 1))
+				goto mismatch;
+			ctx->position += 1;
+			goto match;
+
+		case LIBPARSER_SENTENCE_TYPE_STRING_SET:
+			if (ctx->tokens)
+				goto mismatch;
+			node = sentence->string_set.nodes;
+			best = 0;
+			for (i = ctx->position;; i++) {
+				if (node->match && (!best || node->match < best)) {
+					best = node->match;
+					end = i;
+				}
+				if (!node->least || (best && best < node->least))
+					break;
+				if (i == ctx->length) {
+					if (!ctx->final)
+						goto suspend;
+					break;
+				}
+				c = ((const unsigned char *)ctx->data)[i - ctx->offset];
+				low = node->children;
+				high = low + node->nchildren;
+				while (low < high) {
+					mid = low + (high - low) / 2;
+					if (sentence->string_set.nodes[mid].byte < c)
+						low = mid + 1;
+					else
+						high = mid;
+				}
+				if (low == node->children + node->nchildren || sentence->string_set.nodes[low].byte != c)
+					break;
+				node = &sentence->string_set.nodes[low];
+			}
+			if (!best)
+				goto mismatch;
+			ctx->position = end;
+			goto match;
+
+		case LIBPARSER_SENTENCE_TYPE_RULE:
+			target = sentence->rule.target;
+			if (!target)
+				target = find_rule(ctx->rules, sentence->rule.rule);
+			frame->target = target;
+			if (ctx->profile && !profile_enter(ctx, frame))
+				goto mismatch;
+			if (!ctx->memo || !(memoised = memo_lookup(ctx->memo, target, unit->start)))
+				CALL(target->name, target->sentence, FRAME_RULE);
+			if (!memoised->matched)
+				goto mismatch;
+			if (recognising) {
+				ctx->position = memoised->end;
+				goto match;
+			}
+			unit->in = memo_take(memoised, ctx, &frame->last);
+			if (ctx->error) {
+				free_unit(unit->in, ctx);
+				unit->in = NULL;
+				goto mismatch;
+			}
+			ctx->position = memoised->end;
+			goto match;
+
+		case LIBPARSER_SENTENCE_TYPE_EXCEPTION:
+			ctx->done = 1;
+			ctx->exception = 1;
+			goto match;
+
+		case LIBPARSER_SENTENCE_TYPE_CUT:
+			if (!ctx->rejections)
+				cut(ctx);
+			goto match;
+
+		case LIBPARSER_SENTENCE_TYPE_TOKEN:
+			if (!ctx->tokens)
+				goto mismatch;
+			if (ctx->position == ctx->length)
+				goto end_of_data;
+			if (ctx->tokens[ctx->position].type != sentence->token.id)
+				goto mismatch;
+			ctx->position += 1;
+			goto match;
+
+		case LIBPARSER_SENTENCE_TYPE_EOF:
+			if (ctx->position != ctx->length)
+				goto mismatch;
+			if (!ctx->final)
+				goto suspend;
+			ctx->done = 1;
+			goto match;
+
+		default:
+			abort();
+		}
+
+	prone:
+		if (recognising)
+			goto match;
+		if (unit->in && (!unit->in->rule || unit->in->rule[0] == '_')) {
+			unit->in = unit->in->in;
+			frame->last = last;
+		} else {
+			frame->last = unit->in;
+		}
+	match:
+		unit->end = ctx->position;
+		ret = unit;
+		last = frame->last;
+		if (ctx->profile && sentence->type == LIBPARSER_SENTENCE_TYPE_RULE)
+			profile_leave(ctx, frame, 1);
+		if (ctx->events && !recognising && unit->rule && unit->rule[0] != '_') {
+			if (ctx->events->leave)
+				ctx->events->leave(unit->rule, unit->start, unit->end, ctx->events->user);
+			/* no tree is built, so the unit is made anonymous so that it is spliced away */
+			unit->rule = NULL;
+		}
+		if (--ctx->depth == ctx->stream_depth)
+			ctx->stream_depth = NO_FRAME;
+		if (ctx->cut_depth > ctx->depth)
+			ctx->cut_depth = ctx->depth;
+		continue;
+
+	end_of_data:
+		if (!ctx->final)
+			goto suspend;
+	mismatch:
+		if (ctx->depth <= ctx->cut_depth) {
+			/* backtracking over a cut, stop as at an exception */
+			ctx->done = 1;
+			ctx->exception = 1;
+			goto match;
+		}
+		if (ctx->events)
+			retract_events(ctx, frame->events);
+		if (ctx->profile) {
+			discard_profiled(ctx, frame->profiled);
+			if (sentence->type == LIBPARSER_SENTENCE_TYPE_RULE)
+				profile_leave(ctx, frame, 0);
+		}
+		ctx->position = unit->start;
+		if (!frame->embedded) {
+			unit->next = ctx->cache;
+			ctx->cache = unit;
+			ctx->units -= 1;
+		}
+		ret = NULL;
+		if (--ctx->depth == ctx->stream_depth)
+			ctx->stream_depth = NO_FRAME;
+	next:
+		/* the frame on top is either new or waiting for a failed
+		 * frame, so it can be resumed with ret set to NULL */
+		if (ctx->steps >= ctx->yield_at && ctx->depth > base && !ctx->done) {
+			ctx->yielded = 1;
+			goto suspend;
+		}
+	}
+
+	return ret;
+
+suspend:
+	return NULL;
+}
+
+
+static struct libparser_unit *
+try_match(const char *rule, const union libparser_sentence *sentence, struct context *ctx)
+{
+	size_t base = ctx->depth;
+	if (!push_frame(ctx, rule, sentence))
+		return NULL;
+	return run_frames(ctx, base);
+}
+
+
+/* Prepare a context for a new parse, keeping
+ * its freelist and buffers from previous parses */
+static void
+reset_context(struct context *ctx, const struct libparser_rule *const rules[], const struct libparser_options *options)
+{
+	size_t i;
+
+	if (ctx->rules != rules)
+		for (i = 0; i < SCAN_CACHE_SIZE; i++)
+			ctx->classes[i].key = NULL;
+	ctx->rules = rules;
+	ctx->depth = 0;
+	ctx->max_depth = options ? options->max_depth : 0;
+	ctx->steps = 0;
+	ctx->max_steps = options ? options->max_steps : 0;
+	ctx->units = 0;
+	ctx->max_units = options ? options->max_units : 0;
+	ctx->yield_steps = 0;
+	ctx->yield_at = SIZE_MAX;
+	ctx->tree = NULL;
+	ctx->memo = NULL;
+	ctx->data = NULL;
+	ctx->offset = 0;
+	ctx->length = 0;
+	ctx->position = 0;
+	ctx->stream_depth = NO_FRAME;
+	ctx->cut_depth = 0;
+	ctx->rejections = 0;
+	ctx->recognise_depth = NO_FRAME;
+	ctx->tokens = NULL;
+	ctx->callback = NULL;
+	ctx->user = NULL;
+	ctx->events = NULL;
+	ctx->nevents = 0;
+	ctx->events_base = 0;
+	ctx->profile = options ? options->profile : NULL;
+	ctx->nprofiled = 0;
+	ctx->final = 1;
+	ctx->done = 0;
+	ctx->error = 0;
+	ctx->limited = 0;
+	ctx->exception = 0;
+}
+
+
+static void
+init_context(struct context *ctx, const struct libparser_rule *const rules[], const struct libparser_options *options)
+{
+	size_t i;
+
+	for (i = 0; i < SCAN_CACHE_SIZE; i++)
+		ctx->classes[i].key = NULL;
+	ctx->rules = rules;
+	ctx->cache = NULL;
+	ctx->frames = NULL;
+	ctx->frames_size = 0;
+	ctx->copies = NULL;
+	ctx->copies_size = 0;
+	ctx->log = NULL;
+	ctx->log_size = 0;
+	ctx->profiled = NULL;
+	ctx->profiled_size = 0;
+	reset_context(ctx, rules, options);
+}
+
+
+static void
+free_cache(struct context *ctx)
+{
+	struct libparser_unit *t;
+	while (ctx->cache) {
+		t = ctx->cache;
+		ctx->cache = t->next;
+		free(t);
+	}
+}
+
+
+static int
+parse(const struct libparser_rule *const rules[], const char *data, const struct libparser_token *tokens, size_t length,
+      const struct libparser_options *options, struct libparser_tree *tree, struct libparser_unit **rootp)
+{
+	const struct libparser_rule *start;
+	struct libparser_unit *ret;
+	struct context ctx;
+	struct memo memo;
+
+	init_context(&ctx, rules, options);
+	ctx.tree = tree;
+	ctx.data = data;
+	ctx.tokens = tokens;
+	ctx.length = length;
+
+	start = find_rule(rules, "@start");
+	if (options && (options->flags & LIBPARSER_MEMOISE)) {
+		memset(&memo, 0, sizeof(memo));
+		memo.limit = options->memo_limit;
+		ctx.memo = &memo;
+	}
+
+	ret = try_match(start->name, start->sentence, &ctx);
+
+	if (ctx.memo)
+		memo_destroy(ctx.memo, &ctx);
+	free(ctx.frames);
+	free(ctx.copies);
+	free(ctx.profiled);
+
+	if (tree) {
+		if (ctx.error) {
+			*rootp = NULL;
+			return parse_failure(&ctx);
+		}
+		*rootp = ret;
+		return !ctx.exception;
+	}
+
+	free_cache(&ctx);
+
+	if (ctx.error) {
+		dealloc_unit(ret);
+		*rootp = NULL;
+		return parse_failure(&ctx);
+	}
+
+	*rootp = ret;
+	return !ctx.exception;
+}
+
+
+int
+libparser_parse_file_with_options(const struct libparser_rule *const rules[], const char *data, size_t length,
+                                  const struct libparser_options *options, struct libparser_unit **rootp)
+{
+	return parse(rules, data, NULL, length, options, NULL, rootp);
+}
+
+
+int
+libparser_parse_tree(const struct libparser_rule *const rules[], const char *data, size_t length,
+                     const struct libparser_options *options, struct libparser_tree **treep, struct libparser_unit **rootp)
+{
+	const struct libparser_allocator *allocator = &default_allocator;
+	struct libparser_tree *tree;
+	int ret;
+
+	if (options && options->allocator)
+		allocator = options->allocator;
+
+	tree = allocator->allocate(allocator->user, sizeof(*tree));
+	if (!tree) {
+		*treep = NULL;
+		*rootp = NULL;
+		return -1;
+	}
+	tree->allocator = *allocator;
+	tree->blocks = NULL;
+	tree->free_units = tree->end_units = NULL;
+	tree->block_units = ARENA_MIN_BLOCK_UNITS;
+
+	ret = parse(rules, data, NULL, length, options, tree, rootp);
+	if (ret < 0 || ret == LIBPARSER_LIMIT_REACHED) {
+		libparser_free_tree(tree);
+		tree = NULL;
+	}
+
+	*treep = tree;
+	return ret;
+}
+
+
+static void
+free_blocks(struct libparser_tree *tree)
+{
+	struct arena_block *block, *next;
+	for (block = tree->blocks; block; block = next) {
+		next = block->next;
+		tree->allocator.deallocate(tree->allocator.user, block, block->size);
+	}
+}
+
+
+void
+libparser_free_tree(struct libparser_tree *tree)
+{
+	struct libparser_allocator allocator;
+
+	if (!tree)
+		return;
+
+	allocator = tree->allocator;
+	free_blocks(tree);
+	allocator.deallocate(allocator.user, tree, sizeof(*tree));
+}
+
+
+struct rule_id {
+	uintptr_t name;
+	uint32_t id;
+};
+
+
+static int
+rule_id_cmp(const void *av, const void *bv)
+{
+	const struct rule_id *a = av, *b = bv;
+	return a->name < b->name ? -1 : a->name > b->name;
+}
+
+
+static uint32_t
+get_rule_id(const struct libparser_rule *const rules[], const struct rule_id *ids, size_t nids, const char *name)
+{
+	struct rule_id key, *found;
+	size_t i;
+
+	if (!name)
+		return LIBPARSER_NO_RULE;
+
+	key.name = (uintptr_t)name;
+	found = bsearch(&key, ids, nids, sizeof(*ids), rule_id_cmp);
+	if (found)
+		return found->id;
+
+	for (i = 0; i < nids; i++)
+		if (!strcmp(rules[i]->name, name))
+			return (uint32_t)i;
+	return LIBPARSER_NO_RULE;
+}
+
+
+static int
+flatten(const struct libparser_rule *const rules[], const struct libparser_unit *unit, int wide, struct libparser_flat_tree *tree)
+{
+	const struct libparser_unit **stack = NULL;
+	struct rule_id *ids = NULL;
+	size_t *last = NULL, size = 0, stack_size = 0, nids, i, n = 0, depth = 0;
+	void *new;
+	uint32_t rule;
+
+	for (nids = 0; rules[nids]; nids++);
+	if (nids) {
+		ids = malloc(nids * sizeof(*ids));
+		if (!ids)
+			goto fail;
+		for (i = 0; i < nids; i++) {
+			ids[i].name = (uintptr_t)rules[i]->name;
+			ids[i].id = (uint32_t)i;
+		}
+		qsort(ids, nids, sizeof(*ids), rule_id_cmp);
+	}
+
+	/* preorder traversal, last[d] is the index of the last visited unit at depth d */
+	while (unit) {
+		if (n == size) {
+			if (n > (size_t)UINT32_MAX) {
+				errno = EOVERFLOW;
+				goto fail;
+			}
+			size = size ? size * 2 : 64;
+			if (wide)
+				new = realloc(tree->units64, size * sizeof(*tree->units64));
+			else
+				new = realloc(tree->units, size * sizeof(*tree->units));
+			if (!new)
+				goto fail;
+			if (wide)
+				tree->units64 = new;
+			else
+				tree->units = new;
+		}
+		if (depth + 1 >= stack_size) {
+			stack_size = stack_size ? stack_size * 2 : 16;
+			new = realloc(stack, stack_size * sizeof(*stack));
+			if (!new)
+				goto fail;
+			stack = new;
+			new = realloc(last, stack_size * sizeof(*last));
+			if (!new)
+				goto fail;
+			last = new;
+			if (!depth)
+				last[0] = SIZE_MAX;
+		}
+
+		i = n++;
+		rule = get_rule_id(rules, ids, nids, unit->rule);
+		if (wide) {
+			tree->units64[i].rule = rule;
+			tree->units64[i].in = unit->in ? (uint32_t)(i + 1) : 0;
+			tree->units64[i].next = 0;
+			tree->units64[i].start = (uint64_t)unit->start;
+			tree->units64[i].end = (uint64_t)unit->end;
+			if (last[depth] != SIZE_MAX)
+				tree->units64[last[depth]].next = (uint32_t)i;
+		} else {
+			tree->units[i].rule = rule;
+			tree->units[i].in = unit->in ? (uint32_t)(i + 1) : 0;
+			tree->units[i].next = 0;
+			tree->units[i].start = (uint32_t)unit->start;
+			tree->units[i].end = (uint32_t)unit->end;
+			if (last[depth] != SIZE_MAX)
+				tree->units[last[depth]].next = (uint32_t)i;
+		}
+		last[depth] = i;
+
+		if (unit->in) {
+			stack[depth++] = unit->next;
+			last[depth] = SIZE_MAX;
+			unit = unit->in;
+		} else {
+			for (unit = unit->next; !unit && depth;)
+				unit = stack[--depth];
+		}
+	}
+
+	tree->count = n;
+	free(ids);
+	free(stack);
+	free(last);
+	return 0;
+
+fail:
+	free(ids);
+	free(stack);
+	free(last);
+	return -1;
+}
+
+
+int
+libparser_parse_flat(const struct libparser_rule *const rules[], const char *data, size_t length,
+                     const struct libparser_options *options, struct libparser_flat_tree *treep)
+{
+	struct libparser_unit *root;
+	struct libparser_tree tree;
+	int ret, wide, saved_errno;
+
+	treep->count = 0;
+	treep->units = NULL;
+	treep->units64 = NULL;
+
+	tree.allocator = default_allocator;
+	tree.blocks = NULL;
+	tree.free_units = tree.end_units = NULL;
+	tree.block_units = ARENA_MIN_BLOCK_UNITS;
+
+	ret = parse(rules, data, NULL, length, options, &tree, &root);
+	if (ret < 0 || ret == LIBPARSER_LIMIT_REACHED)
+		goto fail;
+
+	wide = (options && (options->flags & LIBPARSER_FLAT_WIDE)) || length > (size_t)UINT32_MAX;
+	if (flatten(rules, root, wide, treep))
+		goto fail;
+
+	free_blocks(&tree);
+	return ret;
+
+fail:
+	saved_errno = errno;
+	free_blocks(&tree);
+	libparser_free_flat_tree(treep);
+	errno = saved_errno;
+	return ret == LIBPARSER_LIMIT_REACHED ? ret : -1;
+}
+
+
+void
+libparser_free_flat_tree(struct libparser_flat_tree *tree)
+{
+	free(tree->units);
+	free(tree->units64);
+	tree->units = NULL;
+	tree->units64 = NULL;
+	tree->count = 0;
+}
+
+
+struct libparser_context {
+	struct context ctx;
+	struct memo memo;
+	struct libparser_unit *root; /* result of the last parse, owned by the context */
+};
+
+
+struct libparser_context *
+libparser_context_create(void)
+{
+	struct libparser_context *context;
+
+	context = malloc(sizeof(*context));
+	if (!context)
+		return NULL;
+	init_context(&context->ctx, NULL, NULL);
+	memset(&context->memo, 0, sizeof(context->memo));
+	context->root = NULL;
+	return context;
+}
+
+
+int
+libparser_parse_in_context(struct libparser_context *context, const struct libparser_rule *const rules[],
+                           const char *data, size_t length, const struct libparser_options *options,
+                           struct libparser_unit **rootp)
+{
+	struct context *ctx = &context->ctx;
+	const struct libparser_rule *start;
+	struct libparser_unit *ret;
+
+	/* the units of the previous parse are put back in the freelist before they are counted anew */
+	free_unit(context->root, ctx);
+	context->root = NULL;
+
+	reset_context(ctx, rules, options);
+	ctx->data = data;
+	ctx->length = length;
+
+	start = find_rule(rules, "@start");
+	if (options && (options->flags & LIBPARSER_MEMOISE)) {
+		context->memo.limit = options->memo_limit;
+		if (context->memo.limit && context->memo.used > context->memo.limit) {
+			memo_destroy(&context->memo, ctx);
+			memset(&context->memo, 0, sizeof(context->memo));
+			context->memo.limit = options->memo_limit;
+		}
+		ctx->memo = &context->memo;
+	}
+
+	ret = try_match(start->name, start->sentence, ctx);
+
+	/* the results refer to the returned tree, which the caller may modify */
+	memo_clear(&context->memo, ctx);
+
+	if (ctx->error) {
+		free_unit(ret, ctx);
+		*rootp = NULL;
+		return parse_failure(ctx);
+	}
+
+	*rootp = context->root = ret;
+	return !ctx->exception;
+}
+
+
+void
+libparser_context_free(struct libparser_context *context)
+{
+	if (!context)
+		return;
+	free_unit(context->root, &context->ctx);
+	memo_destroy(&context->memo, &context->ctx);
+	free_cache(&context->ctx);
+	free(context->ctx.frames);
+	free(context->ctx.copies);
+	free(context->ctx.profiled);
+	free(context);
+}
+
+
+/* Items not yet taken by a thread in libparser_parse_batch,
+ * the thread takes from the front of its own range, and
+ * other threads steal from the back */
+struct batch_worker {
+	pthread_mutex_t lock;
+	size_t next;
+	size_t end;
+	struct libparser_context *context;
+	struct batch *batch;
+	pthread_t thread;
+};
+
+struct batch {
+	const struct libparser_rule *const *rules;
+	struct libparser_batch_item *items;
+	const struct libparser_options *options;
+	struct batch_worker *workers;
+	size_t nworkers;
+};
+
+
+static int
+take_item(struct batch_worker *worker, size_t *indexp)
+{
+	struct batch *batch = worker->batch;
+	struct batch_worker *victim;
+	size_t i, n, start, end;
+
+	pthread_mutex_lock(&worker->lock);
+	if (worker->next < worker->end) {
+		*indexp = worker->next++;
+		pthread_mutex_unlock(&worker->lock);
+		return 1;
+	}
+	pthread_mutex_unlock(&worker->lock);
+
+	for (i = 1; i < batch->nworkers; i++) {
+		victim = &batch->workers[(size_t)(worker - batch->workers + i) % batch->nworkers];
+		pthread_mutex_lock(&victim->lock);
+		n = victim->end - victim->next;
+		if (!n) {
+			pthread_mutex_unlock(&victim->lock);
+			continue;
+		}
+		end = victim->end;
+		start = victim->end -= (n + 1) / 2;
+		pthread_mutex_unlock(&victim->lock);
+
+		pthread_mutex_lock(&worker->lock);
+		*indexp = start;
+		worker->next = start + 1;
+		worker->end = end;
+		pthread_mutex_unlock(&worker->lock);
+		return 1;
+	}
+	return 0;
+}
+
+
+static void *
+batch_work(void *arg)
+{
+	struct batch_worker *worker = arg;
+	struct batch *batch = worker->batch;
+	struct libparser_batch_item *item;
+	size_t i;
+
+	while (take_item(worker, &i)) {
+		item = &batch->items[i];
+		item->ret = libparser_parse_in_context(worker->context, batch->rules, item->data, item->length,
+		                                       batch->options, &item->root);
+		item->error = item->ret < 0 || item->ret == LIBPARSER_LIMIT_REACHED ? errno : 0;
+		/* the tree is given to the caller rather than reused */
+		worker->context->root = NULL;
+	}
+	return NULL;
+}
+
+
+int
+libparser_parse_batch(const struct libparser_rule *const rules[], struct libparser_batch_item *items, size_t count,
+                      const struct libparser_options *options, size_t nthreads)
+{
+	struct batch batch;
+	struct batch_worker *workers;
+	size_t i, nstarted;
+	long ncpus;
+	int ret = 0;
+
+	if (!nthreads) {
+		ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = ncpus > 0 ? (size_t)ncpus : 1;
+	}
+	if (nthreads > count)
+		nthreads = count ? count : 1;
+	/* the counters in the profile are not shared between threads */
+	if (options && options->profile)
+		nthreads = 1;
+
+	workers = calloc(nthreads, sizeof(*workers));
+	if (!workers)
+		return -1;
+	batch.rules = rules;
+	batch.items = items;
+	batch.options = options;
+	batch.workers = workers;
+	batch.nworkers = nthreads;
+
+	for (i = 0; i < nthreads; i++) {
+		workers[i].context = libparser_context_create();
+		if (!workers[i].context) {
+			ret = -1;
+			goto out;
+		}
+		pthread_mutex_init(&workers[i].lock, NULL);
+		workers[i].next = count / nthreads * i + (i < count % nthreads ? i : count % nthreads);
+		workers[i].end = workers[i].next + count / nthreads + (i < count % nthreads);
+		workers[i].batch = &batch;
+	}
+
+	/* the calling thread is worker 0, if a thread cannot be
+	 * created, its items are stolen by the other threads */
+	for (nstarted = 1; nstarted < nthreads; nstarted++)
+		if (pthread_create(&workers[nstarted].thread, NULL, &batch_work, &workers[nstarted]))
+			break;
+	batch_work(&workers[0]);
+	for (i = 1; i < nstarted; i++)
+		pthread_join(workers[i].thread, NULL);
+
+out:
+	for (i = 0; i < nthreads && workers[i].context; i++) {
+		pthread_mutex_destroy(&workers[i].lock);
+		libparser_context_free(workers[i].context);
+	}
+	free(workers);
+	return ret;
+}
+
+
+int
+libparser_parse_events(const struct libparser_rule *const rules[], const char *data, size_t length,
+                       const struct libparser_options *options, const struct libparser_events *events)
+{
+	const struct libparser_rule *start;
+	struct context ctx;
+
+	init_context(&ctx, rules, options);
+	ctx.data = data;
+	ctx.length = length;
+	ctx.events = events;
+
+	/* no units are allocated, as all are hidden once matched */
+	start = find_rule(rules, "@start");
+	try_match(start->name, start->sentence, &ctx);
+
+	free_cache(&ctx);
+	free(ctx.frames);
+	free(ctx.copies);
+	free(ctx.profiled);
+	free(ctx.log);
+
+	if (ctx.error)
+		return parse_failure(&ctx);
+	return !ctx.exception;
+}
+
+
+int
+libparser_parse_tokens(const struct libparser_rule *const rules[], const struct libparser_token *tokens, size_t count,
+                       const struct libparser_options *options, struct libparser_unit **rootp)
+{
+	return parse(rules, NULL, tokens, count, options, NULL, rootp);
+}
+
+
+int
+libparser_match(const struct libparser_rule *const rules[], const char *data, size_t length,
+                const struct libparser_options *options, size_t *endp)
+{
+	const struct libparser_rule *start;
+	struct libparser_unit *ret;
+	struct context ctx;
+
+	init_context(&ctx, rules, options);
+	ctx.data = data;
+	ctx.length = length;
+	ctx.recognise_depth = 0;
+
+	start = find_rule(rules, "@start");
+	ret = try_match(start->name, start->sentence, &ctx);
+	if (endp)
+		*endp = ret ? ret->end : 0;
+
+	free_cache(&ctx);
+	free(ctx.frames);
+	free(ctx.copies);
+	free(ctx.profiled);
+
+	if (ctx.error)
+		return parse_failure(&ctx);
+	return ret && !ctx.exception;
+}
+
+
+struct libparser_stream {
+	struct context ctx;
+	char *buffer; /* .ctx.data */
+	size_t size; /* allocation size of .buffer */
+	struct libparser_unit *root;
+	int status; /* LIBPARSER_NEED_INPUT until the parsing has completed */
+};
+
+
+struct libparser_profile *
+libparser_profile_create(void)
+{
+	return calloc(1, sizeof(struct libparser_profile));
+}
+
+
+static int
+compare_rule_profiles(const void *a_, const void *b_)
+{
+	const struct libparser_rule_profile *a = a_, *b = b_;
+	if (a->nanoseconds != b->nanoseconds)
+		return a->nanoseconds > b->nanoseconds ? -1 : +1;
+	if (a->invocations != b->invocations)
+		return a->invocations > b->invocations ? -1 : +1;
+	return strcmp(a->rule->name, b->rule->name);
+}
+
+
+const struct libparser_rule_profile *
+libparser_profile_rules(struct libparser_profile *profile, size_t *countp)
+{
+	struct libparser_rule_profile *sorted;
+	size_t i, n = 0;
+
+	sorted = malloc((profile->count ? profile->count : 1) * sizeof(*sorted));
+	if (!sorted)
+		return NULL;
+	for (i = 0; i < profile->size; i++)
+		if (profile->rules[i].rule)
+			sorted[n++] = profile->rules[i];
+	qsort(sorted, n, sizeof(*sorted), &compare_rule_profiles);
+
+	free(profile->sorted);
+	profile->sorted = sorted;
+	*countp = n;
+	return sorted;
+}
+
+
+int
+libparser_profile_print(struct libparser_profile *profile, int fd)
+{
+	const struct libparser_rule_profile *rules;
+	size_t i, count, width = sizeof("rule") - 1;
+
+	rules = libparser_profile_rules(profile, &count);
+	if (!rules)
+		return -1;
+	for (i = 0; i < count; i++)
+		if (strlen(rules[i].rule->name) > width)
+			width = strlen(rules[i].rule->name);
+
+	if (dprintf(fd, "%-*s %12s %12s %12s %12s %14s\n", (int)width, "rule",
+	            "invocations", "matches", "failures", "backtracked", "nanoseconds") < 0)
+		return -1;
+	for (i = 0; i < count; i++) {
+		if (dprintf(fd, "%-*s %12zu %12zu %12zu %12zu %14llu\n", (int)width, rules[i].rule->name,
+		            rules[i].invocations, rules[i].matches, rules[i].failures, rules[i].backtracked,
+		            (unsigned long long int)rules[i].nanoseconds) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+
+void
+libparser_profile_free(struct libparser_profile *profile)
+{
+	if (profile) {
+		free(profile->rules);
+		free(profile->sorted);
+		free(profile);
+	}
+}
+
+
+struct libparser_stream *
+libparser_stream_create(const struct libparser_rule *const rules[], const struct libparser_options *options,
+                        void (*callback)(struct libparser_unit *unit, const char *text, void *user), void *user)
+{
+	const struct libparser_rule *start;
+	struct libparser_stream *stream;
+
+	stream = malloc(sizeof(*stream));
+	if (!stream)
+		return NULL;
+	init_context(&stream->ctx, rules, options);
+	stream->ctx.profile = NULL;
+	stream->ctx.yield_steps = options ? options->yield_steps : 0;
+	stream->ctx.callback = callback;
+	stream->ctx.user = user;
+	stream->ctx.final = 0;
+	stream->buffer = NULL;
+	stream->size = 0;
+	stream->root = NULL;
+	stream->status = LIBPARSER_NEED_INPUT;
+
+	start = find_rule(rules, "@start");
+	if (!push_frame(&stream->ctx, start->name, start->sentence)) {
+		errno = stream->ctx.error;
+		libparser_stream_free(stream);
+		return NULL;
+	}
+	return stream;
+}
+
+
+static int
+resume_stream(struct libparser_stream *stream)
+{
+	struct context *ctx = &stream->ctx;
+	struct libparser_unit *ret;
+
+	ctx->yielded = 0;
+	if (ctx->yield_steps && ctx->steps < SIZE_MAX - ctx->yield_steps)
+		ctx->yield_at = ctx->steps + ctx->yield_steps;
+	ret = run_frames(ctx, 0);
+	if (ctx->depth)
+		return ctx->yielded ? LIBPARSER_WOULD_BLOCK : LIBPARSER_NEED_INPUT;
+
+	if (ctx->error) {
+		free_unit(ret, ctx);
+		stream->status = parse_failure(ctx);
+	} else {
+		stream->root = ret;
+		stream->status = !ctx->exception;
+	}
+	return stream->status;
+}
+
+
+int
+libparser_stream_feed(struct libparser_stream *stream, const char *data, size_t length)
+{
+	struct context *ctx = &stream->ctx;
+	size_t keep = 0, used, size;
+	char *new;
+
+	if (stream->status != LIBPARSER_NEED_INPUT) {
+		if (ctx->error)
+			errno = ctx->error;
+		return stream->status;
+	}
+
+	/* drop the input that can no longer be read */
+	if (ctx->stream_depth != NO_FRAME) {
+		if (ctx->stream_depth + 1 < ctx->depth)
+			keep = ctx->frames[ctx->stream_depth + 1].unit->start;
+		else
+			keep = ctx->position;
+	}
+	if (keep > ctx->offset) {
+		memmove(stream->buffer, &stream->buffer[keep - ctx->offset], ctx->length - keep);
+		ctx->offset = keep;
+	}
+
+	used = ctx->length - ctx->offset;
+	if (length > stream->size - used) {
+		if (length > SIZE_MAX - used) {
+			errno = ENOMEM;
+			return -1;
+		}
+		size = stream->size > SIZE_MAX / 2 ? SIZE_MAX : stream->size * 2;
+		if (size < used + length)
+			size = used + length;
+		new = realloc(stream->buffer, size);
+		if (!new)
+			return -1;
+		stream->buffer = new;
+		stream->size = size;
+	}
+	if (length)
+		memcpy(&stream->buffer[used], data, length);
+	ctx->data = stream->buffer;
+	ctx->length += length;
+
+	return resume_stream(stream);
+}
+
+
+int
+libparser_stream_end(struct libparser_stream *stream, struct libparser_unit **rootp)
+{
+	if (stream->status == LIBPARSER_NEED_INPUT) {
+		stream->ctx.final = 1;
+		if (resume_stream(stream) == LIBPARSER_WOULD_BLOCK) {
+			*rootp = NULL;
+			return LIBPARSER_WOULD_BLOCK;
+		}
+	} else if (stream->ctx.error) {
+		errno = stream->ctx.error;
+	}
+	*rootp = stream->root;
+	stream->root = NULL;
+	return stream->status;
+}
+
+
+void
+libparser_stream_free(struct libparser_stream *stream)
+{
+	struct context *ctx;
+	size_t i;
+
+	if (!stream)
+		return;
+	ctx = &stream->ctx;
+	for (i = 0; i < ctx->depth && i < ctx->recognise_depth; i++)
+		free_unit(ctx->frames[i].embedded ? ctx->frames[i].unit->in : ctx->frames[i].unit, ctx);
+	free_unit(stream->root, ctx);
+	free_cache(ctx);
+	free(ctx->frames);
+	free(ctx->copies);
+	free(ctx->profiled);
+	free(stream->buffer);
+	free(stream);
+}
+
+
+int
+libparser_parse_file(const struct libparser_rule *const rules[], const char *data, size_t length, struct libparser_unit **rootp)
+{
+	return libparser_parse_file_with_options(rules, data, length, NULL, rootp);
 }
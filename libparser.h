@@ -3,6 +3,7 @@
 #define LIBPARSER_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 
 /* This is mostly internal (unless you want to programmatically create a grammar) { */
@@ -19,18 +20,51 @@ enum libparser_sentence_type {
 	LIBPARSER_SENTENCE_TYPE_CHAR_RANGE,    /* .char_range */
 	LIBPARSER_SENTENCE_TYPE_RULE,          /* .rule */
 	LIBPARSER_SENTENCE_TYPE_EXCEPTION,     /* (none) */
-	LIBPARSER_SENTENCE_TYPE_EOF            /* (none) */
+	LIBPARSER_SENTENCE_TYPE_EOF,           /* (none) */
+	LIBPARSER_SENTENCE_TYPE_CHAR_SET,      /* .char_set */
+	LIBPARSER_SENTENCE_TYPE_STRING_SET,    /* .string_set */
+	LIBPARSER_SENTENCE_TYPE_CUT,           /* (none) */
+	LIBPARSER_SENTENCE_TYPE_TOKEN,         /* .token */
+	LIBPARSER_SENTENCE_TYPE_SEQUENCE,      /* .nary */
+	LIBPARSER_SENTENCE_TYPE_CHOICE         /* .nary */
+};
+
+/**
+ * The bytes a match of a sentence can begin with,
+ * used to skip sentences that cannot match
+ */
+struct libparser_first_set {
+	unsigned char bytes[32]; /* bit (c & 7) in bytes[c >> 3] is set if a match can begin with the byte c */
+	unsigned char nullable; /* non-zero if the sentence can match without consuming any input */
 };
 
 struct libparser_sentence_binary {
 	enum libparser_sentence_type type;
 	const union libparser_sentence *left;
 	const union libparser_sentence *right;
+	const struct libparser_first_set *left_first; /* optional, only used by LIBPARSER_SENTENCE_TYPE_ALTERNATION */
+	const struct libparser_first_set *right_first; /* optional, only used by LIBPARSER_SENTENCE_TYPE_ALTERNATION */
+};
+
+/**
+ * Concatenation (LIBPARSER_SENTENCE_TYPE_SEQUENCE) or
+ * alternation (LIBPARSER_SENTENCE_TYPE_CHOICE) of any
+ * number of sentences, matched as a chain of
+ * LIBPARSER_SENTENCE_TYPE_CONCATENATION or
+ * LIBPARSER_SENTENCE_TYPE_ALTERNATION nested to the left,
+ * but without a frame for each link in the chain
+ */
+struct libparser_sentence_nary {
+	enum libparser_sentence_type type;
+	size_t count; /* at least 2 */
+	const union libparser_sentence *const *sentences;
+	const struct libparser_first_set *const *first; /* optional, first set of each of .sentences (or NULL), only used by LIBPARSER_SENTENCE_TYPE_CHOICE */
 };
 
 struct libparser_sentence_unary {
 	enum libparser_sentence_type type;
 	const union libparser_sentence *sentence;
+	const struct libparser_first_set *first; /* optional, first set of .sentence */
 };
 
 struct libparser_sentence_string {
@@ -45,18 +79,59 @@ struct libparser_sentence_char_range {
 	unsigned char high;
 };
 
+struct libparser_sentence_char_set {
+	enum libparser_sentence_type type;
+	unsigned char set[32]; /* bit (c & 7) in set[c >> 3] is set if the byte c is matched */
+};
+
+/**
+ * Node in the byte trie of a struct libparser_sentence_string_set
+ */
+struct libparser_string_set_node {
+	unsigned char byte; /* the byte on the edge from the parent node */
+	unsigned short nchildren;
+	size_t children; /* index of the first child, the children are sorted by .byte */
+	size_t match; /* 1 + index of the first alternative that ends at the node, 0 if none */
+	size_t least; /* smallest non-zero .match among the descendants, 0 if none */
+};
+
+/**
+ * Alternation of strings, the first (leftmost) alternative
+ * that matches is chosen, exactly as for a chain of
+ * LIBPARSER_SENTENCE_TYPE_ALTERNATION
+ */
+struct libparser_sentence_string_set {
+	enum libparser_sentence_type type;
+	const struct libparser_string_set_node *nodes; /* nodes[0] is the root */
+};
+
 struct libparser_sentence_rule {
 	enum libparser_sentence_type type;
 	const char *rule;
+	const struct libparser_rule *target; /* optional, if NULL .rule is looked up in the rule table */
+};
+
+/**
+ * Matches one token of a type, only
+ * used by libparser_parse_tokens
+ */
+struct libparser_sentence_token {
+	enum libparser_sentence_type type;
+	const char *name;
+	unsigned int id; /* index of .name in libparser_token_type_table */
 };
 
 union libparser_sentence { 
 	enum libparser_sentence_type type;
 	struct libparser_sentence_binary binary;
+	struct libparser_sentence_nary nary;
 	struct libparser_sentence_unary unary;
 	struct libparser_sentence_string string;
 	struct libparser_sentence_char_range char_range;
+	struct libparser_sentence_char_set char_set;
+	struct libparser_sentence_string_set string_set;
 	struct libparser_sentence_rule rule;
+	struct libparser_sentence_token token;
 };
 
 struct libparser_rule {
@@ -76,9 +151,226 @@ struct libparser_unit {
 };
 
 
+/**
+ * Remember the result of each rule at each input position,
+ * so that no rule is evaluated more than once at the same
+ * position (packrat parsing)
+ */
+#define LIBPARSER_MEMOISE 0x0001
+
+/**
+ * Make libparser_parse_flat use .units64
+ * even if the input is short enough for .units
+ */
+#define LIBPARSER_FLAT_WIDE 0x0002
+
+/**
+ * Node in a struct libparser_flat_tree, with
+ * the same meaning as struct libparser_unit,
+ * except that .in and .next are indices in
+ * the array the node is stored in (0 if none,
+ * as the root is always stored at index 0),
+ * and .rule is the index of the rule in the
+ * rule table (LIBPARSER_NO_RULE if none)
+ */
+struct libparser_flat_unit {
+	uint32_t rule;
+	uint32_t in;
+	uint32_t next;
+	uint32_t start;
+	uint32_t end;
+};
+
+struct libparser_flat_unit64 {
+	uint32_t rule;
+	uint32_t in;
+	uint32_t next;
+	uint64_t start;
+	uint64_t end;
+};
+
+/**
+ * Parse tree stored in preorder in a single array;
+ * .units is used unless .units64 is non-NULL
+ */
+struct libparser_flat_tree {
+	size_t count;
+	struct libparser_flat_unit *units;
+	struct libparser_flat_unit64 *units64;
+};
+
+#define LIBPARSER_NO_RULE UINT32_MAX
+
+struct libparser_allocator {
+	void *(*allocate)(void *user, size_t size);
+	void (*deallocate)(void *user, void *ptr, size_t size);
+	void *user;
+};
+
+/**
+ * Per-rule counters collected with struct libparser_profile
+ */
+struct libparser_rule_profile {
+	const struct libparser_rule *rule;
+	size_t invocations;
+	size_t matches;
+	size_t failures;
+	size_t backtracked; /* positions matched by the rule and then discarded by backtracking */
+	uint64_t nanoseconds; /* time spent in the rule, including the rules it uses */
+};
+
+/**
+ * Counters for each rule, added to by every
+ * parse it is given to in struct libparser_options
+ */
+struct libparser_profile;
+
+struct libparser_options {
+	unsigned int flags;
+	size_t memo_limit; /* maximum number of bytes used for the results remembered by LIBPARSER_MEMOISE, 0 for no limit */
+	const struct libparser_allocator *allocator; /* used by libparser_parse_tree, NULL for malloc(3)/free(3) */
+	size_t max_depth; /* maximum nesting of sentences being matched, 0 for no limit */
+	struct libparser_profile *profile; /* NULL unless the parse shall be profiled */
+	size_t max_steps; /* maximum number of sentences matched, 0 for no limit */
+	size_t max_units; /* maximum number of parse tree nodes in use at once, 0 for no limit */
+	size_t yield_steps; /* used by streams, number of sentences matched before returning LIBPARSER_WOULD_BLOCK, 0 for no limit */
+};
+
+/**
+ * Input for libparser_parse_tokens, as produced by a lexer
+ */
+struct libparser_token {
+	unsigned int type; /* index in libparser_token_type_table */
+	size_t start; /* not used by libparser */
+	size_t end; /* not used by libparser */
+};
+
+/**
+ * Parser state kept between parses, so that
+ * memory can be reused rather than reallocated
+ */
+struct libparser_context;
+
+/**
+ * Input and result of one parse in libparser_parse_batch
+ */
+struct libparser_batch_item {
+	const char *data;
+	size_t length;
+	struct libparser_unit *root; /* set by libparser_parse_batch */
+	int ret; /* set by libparser_parse_batch, the return value of the parse */
+	int error; /* set by libparser_parse_batch, the errno value if .ret is -1 */
+};
+
+/**
+ * Callbacks for libparser_parse_events, any of which may be NULL
+ */
+struct libparser_events {
+	void (*enter)(const char *rule, size_t start, void *user); /* rule may match at start */
+	void (*leave)(const char *rule, size_t start, size_t end, void *user); /* rule matched start to end */
+	void (*retract)(const char *rule, size_t start, void *user); /* rule entered at start did not match after all */
+	void *user;
+};
+
+/**
+ * Returned instead of -1 when parsing failed because
+ * of a limit in struct libparser_options
+ */
+#define LIBPARSER_LIMIT_REACHED 3
+
+/**
+ * Returned by libparser_stream_feed when the
+ * input so far is a prefix of a possible match
+ */
+#define LIBPARSER_NEED_INPUT 2
+
+/**
+ * Returned by libparser_stream_feed and libparser_stream_end
+ * when the parser has yielded because of .yield_steps in
+ * struct libparser_options, call the function again (with
+ * no input for libparser_stream_feed) to continue
+ */
+#define LIBPARSER_WOULD_BLOCK 4
+
+/**
+ * Parser that is given its input in chunks
+ */
+struct libparser_stream;
+
+/**
+ * Parse tree whose units are allocated in bulk
+ * and deallocated all at once with libparser_free_tree
+ */
+struct libparser_tree;
+
+
 extern const struct libparser_rule *const libparser_rule_table[];
 
+/**
+ * The names of the token types (%type) used by the
+ * grammar, the index of a name is its type number
+ */
+extern const char *const libparser_token_type_table[];
+
+/**
+ * Only defined if the grammar was generated with
+ * `libparser-generate --emit-code`, equivalent to
+ * libparser_parse_file(libparser_rule_table, ...)
+ */
+int libparser_parse_file_compiled(const char *data, size_t length, struct libparser_unit **rootp);
+
 
 int libparser_parse_file(const struct libparser_rule *const rules[], const char *data, size_t length, struct libparser_unit **rootp);
 
+int libparser_parse_file_with_options(const struct libparser_rule *const rules[], const char *data, size_t length,
+                                      const struct libparser_options *options, struct libparser_unit **rootp);
+
+int libparser_parse_tree(const struct libparser_rule *const rules[], const char *data, size_t length,
+                         const struct libparser_options *options, struct libparser_tree **treep, struct libparser_unit **rootp);
+
+void libparser_free_tree(struct libparser_tree *tree);
+
+int libparser_parse_flat(const struct libparser_rule *const rules[], const char *data, size_t length,
+                         const struct libparser_options *options, struct libparser_flat_tree *treep);
+
+void libparser_free_flat_tree(struct libparser_flat_tree *tree);
+
+struct libparser_context *libparser_context_create(void);
+
+int libparser_parse_in_context(struct libparser_context *context, const struct libparser_rule *const rules[],
+                               const char *data, size_t length, const struct libparser_options *options,
+                               struct libparser_unit **rootp);
+
+void libparser_context_free(struct libparser_context *context);
+
+int libparser_parse_tokens(const struct libparser_rule *const rules[], const struct libparser_token *tokens, size_t count,
+                           const struct libparser_options *options, struct libparser_unit **rootp);
+
+int libparser_match(const struct libparser_rule *const rules[], const char *data, size_t length,
+                    const struct libparser_options *options, size_t *endp);
+
+int libparser_parse_events(const struct libparser_rule *const rules[], const char *data, size_t length,
+                           const struct libparser_options *options, const struct libparser_events *events);
+
+int libparser_parse_batch(const struct libparser_rule *const rules[], struct libparser_batch_item *items, size_t count,
+                          const struct libparser_options *options, size_t nthreads);
+
+struct libparser_profile *libparser_profile_create(void);
+
+const struct libparser_rule_profile *libparser_profile_rules(struct libparser_profile *profile, size_t *countp);
+
+int libparser_profile_print(struct libparser_profile *profile, int fd);
+
+void libparser_profile_free(struct libparser_profile *profile);
+
+struct libparser_stream *libparser_stream_create(const struct libparser_rule *const rules[], const struct libparser_options *options,
+                                                 void (*callback)(struct libparser_unit *unit, const char *text, void *user),
+                                                 void *user);
+
+int libparser_stream_feed(struct libparser_stream *stream, const char *data, size_t length);
+
+int libparser_stream_end(struct libparser_stream *stream, struct libparser_unit **rootp);
+
+void libparser_stream_free(struct libparser_stream *stream);
+
 #endif
@@ -11,10 +11,71 @@
 #include "libparser.h"
 
 
+#define IN_SET(SET, C) (((SET)[(C) >> 3] >> ((C) & 7)) & 1)
+
+
 static int
-print_sentence(const union libparser_sentence *sentence, int indent)
+print_char(unsigned c)
 {
 	int len;
+	if (isprint(c))
+		printf("\"%c\"%n", c, &len);
+	else
+		printf("0x%02x%n", c, &len);
+	return len;
+}
+
+
+struct path {
+	const struct path *prev;
+	unsigned char byte;
+};
+
+
+static int
+print_path(const struct path *path)
+{
+	int len;
+	if (!path)
+		return 0;
+	len = print_path(path->prev);
+	if (isprint(path->byte) && path->byte != '"' && path->byte != '\\')
+		printf("%c", path->byte);
+	else
+		printf("\\x%02x", path->byte);
+	return len + (isprint(path->byte) && path->byte != '"' && path->byte != '\\' ? 1 : 4);
+}
+
+
+static int
+print_string_set_alternative(const struct libparser_string_set_node *nodes, size_t node,
+                             const struct path *prev, size_t match, int *firstp)
+{
+	struct path path;
+	size_t i;
+	int len = 0;
+
+	if (nodes[node].match == match) {
+		printf("%s\"", *firstp ? "" : " | ");
+		len = print_path(prev) + (*firstp ? 2 : 5);
+		printf("\"");
+		*firstp = 0;
+	}
+	path.prev = prev;
+	for (i = nodes[node].children; i < nodes[node].children + nodes[node].nchildren; i++) {
+		path.byte = nodes[i].byte;
+		len += print_string_set_alternative(nodes, i, &path, match, firstp);
+	}
+	return len;
+}
+
+
+static int
+print_sentence(const union libparser_sentence *sentence, int indent)
+{
+	size_t match, nnodes, i;
+	unsigned c, high;
+	int len, first = 1;
 
 	switch (sentence->type) {
 	case LIBPARSER_SENTENCE_TYPE_CONCATENATION:
@@ -35,6 +96,28 @@ print_sentence(const union libparser_sentence *sentence, int indent)
 		indent + 1;
 		break;
 
+	case LIBPARSER_SENTENCE_TYPE_SEQUENCE:
+		printf("(");
+		indent = print_sentence(sentence->nary.sentences[0], indent + 1);
+		for (i = 1; i < sentence->nary.count; i++) {
+			printf(", ");
+			indent = print_sentence(sentence->nary.sentences[i], indent + 2);
+		}
+		printf(")");
+		indent += 1;
+		break;
+
+	case LIBPARSER_SENTENCE_TYPE_CHOICE:
+		printf("(");
+		for (i = 0; i < sentence->nary.count; i++) {
+			if (i)
+				printf(" | \n%*.s", indent + 1, "");
+			len = print_sentence(sentence->nary.sentences[i], indent + 1);
+		}
+		printf(")");
+		indent = len + 1;
+		break;
+
 	case LIBPARSER_SENTENCE_TYPE_REJECTION:
 		printf("!(");
 		indent = print_sentence(sentence->unary.sentence, indent + 2);
@@ -73,6 +156,40 @@ print_sentence(const union libparser_sentence *sentence, int indent)
 		indent += len;
 		break;
 
+	case LIBPARSER_SENTENCE_TYPE_CHAR_SET:
+		printf("(");
+		indent += 1;
+		for (c = 0; c < 256; c = high + 1) {
+			high = c;
+			if (!IN_SET(sentence->char_set.set, c))
+				continue;
+			while (high < 255 && IN_SET(sentence->char_set.set, high + 1))
+				high++;
+			printf("%s<%n", first ? "" : " | ", &len);
+			indent += len + print_char(c);
+			printf(", ");
+			indent += 2 + print_char(high);
+			printf(">");
+			indent += 1;
+			first = 0;
+		}
+		printf(")");
+		indent += 1;
+		break;
+
+	case LIBPARSER_SENTENCE_TYPE_STRING_SET:
+		printf("(");
+		indent += 1;
+		/* each alternative ends at a different node, other than the root */
+		for (nnodes = 1, i = 0; i < nnodes; i++)
+			if (sentence->string_set.nodes[i].children + sentence->string_set.nodes[i].nchildren > nnodes)
+				nnodes = sentence->string_set.nodes[i].children + sentence->string_set.nodes[i].nchildren;
+		for (match = 1; match < nnodes; match++)
+			indent += print_string_set_alternative(sentence->string_set.nodes, 0, NULL, match, &first);
+		printf(")");
+		indent += 1;
+		break;
+
 	case LIBPARSER_SENTENCE_TYPE_RULE:
 		printf("%s%n", sentence->rule.rule, &len);
 		indent += len;
@@ -83,6 +200,16 @@ print_sentence(const union libparser_sentence *sentence, int indent)
 		indent += 1;
 		break;
 
+	case LIBPARSER_SENTENCE_TYPE_CUT:
+		printf("^");
+		indent += 1;
+		break;
+
+	case LIBPARSER_SENTENCE_TYPE_TOKEN:
+		printf("%%%s%n", sentence->token.name, &len);
+		indent += len;
+		break;
+
 	case LIBPARSER_SENTENCE_TYPE_EOF:
 		printf("%s%n", "!<0x00, 0xFF>", &len);
 		indent += len;
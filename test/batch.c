@@ -0,0 +1,105 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libparser.h>
+
+
+#define COUNT 1000
+#define THREADS 4
+
+
+static int
+same_tree(const struct libparser_unit *a, const struct libparser_unit *b)
+{
+	for (; a && b; a = a->next, b = b->next) {
+		if (a->start != b->start || a->end != b->end || (a->rule ? !b->rule || strcmp(a->rule, b->rule) : !!b->rule))
+			return 0;
+		if (!same_tree(a->in, b->in))
+			return 0;
+	}
+	return !a && !b;
+}
+
+
+static void
+free_tree(struct libparser_unit *unit)
+{
+	struct libparser_unit *next;
+	for (; unit; unit = next) {
+		free_tree(unit->in);
+		next = unit->next;
+		free(unit);
+	}
+}
+
+
+/* Make an expression, sometimes a malformed one, whose length varies a lot
+ * between inputs so that the threads run out of inputs at different times */
+static char *
+make_input(size_t i, size_t *lengthp)
+{
+	static const char *const parts[] = {"1", "23", " + ", " - ", " * ", "/", "(", ")", "4'5", " "};
+	size_t n = i % 97 ? i % 13 + 1 : 2000, j, length = 0;
+	unsigned long int seed = (unsigned long int)i * 2654435761UL + 1;
+	char *data = malloc(n * 4 + 1);
+
+	if (!data) {
+		perror("test/batch: malloc");
+		exit(1);
+	}
+	for (j = 0; j < n; j++) {
+		seed = seed * 1103515245UL + 12345UL;
+		strcpy(&data[length], parts[(seed >> 16) % (sizeof(parts) / sizeof(*parts))]);
+		length += strlen(&data[length]);
+	}
+	*lengthp = length;
+	return data;
+}
+
+
+static int
+check(const struct libparser_options *options)
+{
+	static struct libparser_batch_item items[COUNT];
+	struct libparser_unit *root;
+	size_t i;
+	int ret, failed = 0;
+
+	for (i = 0; i < COUNT; i++)
+		items[i].data = make_input(i, &items[i].length);
+
+	if (libparser_parse_batch(libparser_rule_table, items, COUNT, options, THREADS)) {
+		perror("test/batch: libparser_parse_batch");
+		exit(1);
+	}
+
+	for (i = 0; i < COUNT; i++) {
+		ret = libparser_parse_file_with_options(libparser_rule_table, items[i].data, items[i].length, options, &root);
+		if (ret < 0) {
+			perror("test/batch: libparser_parse_file_with_options");
+			exit(1);
+		}
+		if (items[i].ret != ret || !same_tree(items[i].root, root)) {
+			fprintf(stderr, "test/batch: input %zu differs with libparser_parse_batch%s\n",
+			        i, options ? " and LIBPARSER_MEMOISE" : "");
+			failed = 1;
+		}
+		free_tree(root);
+		free_tree(items[i].root);
+		free((char *)items[i].data);
+	}
+	return failed;
+}
+
+
+int
+main(void)
+{
+	struct libparser_options options;
+
+	memset(&options, 0, sizeof(options));
+	options.flags = LIBPARSER_MEMOISE;
+
+	return check(NULL) | check(&options);
+}
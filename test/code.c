@@ -0,0 +1,88 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libparser.h>
+
+
+static const char *const inputs[] = {
+	"1",
+	"12 + 3 * (4 - 5'6) - 7 / 8",
+	"((((1))))",
+	"-1 + +2",
+	"1 2 (3)",
+	"1 \xe2\x88\x92 2 \xc3\x97 3",
+	"1 (* comment *) + 2",
+	"1 (* unterminated",
+	"1 +",
+	"(1",
+	"1 * ",
+	"+",
+	""
+};
+
+
+static int
+same_tree(const struct libparser_unit *a, const struct libparser_unit *b)
+{
+	for (; a && b; a = a->next, b = b->next) {
+		if (a->start != b->start || a->end != b->end || (a->rule ? !b->rule || strcmp(a->rule, b->rule) : !!b->rule))
+			return 0;
+		if (!same_tree(a->in, b->in))
+			return 0;
+	}
+	return !a && !b;
+}
+
+
+static void
+free_tree(struct libparser_unit *unit)
+{
+	struct libparser_unit *next;
+	for (; unit; unit = next) {
+		free_tree(unit->in);
+		next = unit->next;
+		free(unit);
+	}
+}
+
+
+static int
+check(const char *data, size_t length)
+{
+	struct libparser_unit *root, *compiled_root;
+	int ret, compiled_ret, failed = 0;
+
+	ret = libparser_parse_file(libparser_rule_table, data, length, &root);
+	compiled_ret = libparser_parse_file_compiled(data, length, &compiled_root);
+	if (ret < 0 || compiled_ret < 0) {
+		perror("test/code: parse failed");
+		exit(1);
+	}
+	if (ret != compiled_ret || !same_tree(root, compiled_root)) {
+		fprintf(stderr, "test/code: tree differs for \"%.*s\"\n", (int)(length < 40 ? length : 40), data);
+		failed = 1;
+	}
+	free_tree(root);
+	free_tree(compiled_root);
+	return failed;
+}
+
+
+int
+main(void)
+{
+	static char data[10 * 4096];
+	size_t i, length = 0;
+	int failed = 0;
+
+	for (i = 0; i < sizeof(inputs) / sizeof(*inputs); i++)
+		failed |= check(inputs[i], strlen(inputs[i]));
+
+	/* a long expression, whose terms are spliced into hyper1, and its prefixes */
+	for (i = 0; length + 32 < sizeof(data); i++)
+		length += (size_t)sprintf(&data[length], "%s%zu * (%zu)", i ? " + " : "", i % 100, i);
+	for (i = length; i; i = i * 3 / 4)
+		failed |= check(data, i);
+	return failed;
+}
@@ -0,0 +1,109 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libparser.h>
+
+
+/* records that need no backtracking over a cut */
+static const char *const good[] = {
+	"",
+	"a = 1;",
+	" a=1 ; bc = 23;d =4 ; ",
+	"a = 1; b"
+};
+
+/* records where a pair has to be backtracked to an alias */
+static const char *const bad[] = {
+	"a = b;",
+	"a = 1; b = c; d = 2;"
+};
+
+
+static int
+same_name(const char *plain, const char *cut)
+{
+	if (!plain || !cut)
+		return !plain && !cut;
+	if (!strncmp(cut, "cut_", 4))
+		cut = &cut[4];
+	return !strcmp(plain, cut);
+}
+
+
+/* Compare the tree of "-" followed by some input with
+ * the tree of "^" followed by the same input */
+static int
+same_tree(const struct libparser_unit *plain, const struct libparser_unit *cut)
+{
+	for (; plain && cut; plain = plain->next, cut = cut->next) {
+		if (plain->start != cut->start || plain->end != cut->end || !same_name(plain->rule, cut->rule))
+			return 0;
+		if (!same_tree(plain->in, cut->in))
+			return 0;
+	}
+	return !plain && !cut;
+}
+
+
+static void
+free_tree(struct libparser_unit *unit)
+{
+	struct libparser_unit *next;
+	for (; unit; unit = next) {
+		free_tree(unit->in);
+		next = unit->next;
+		free(unit);
+	}
+}
+
+
+static int
+parse(char prefix, const char *input, struct libparser_unit **rootp)
+{
+	char data[64];
+	int ret;
+
+	data[0] = prefix;
+	strcpy(&data[1], input);
+	ret = libparser_parse_file(libparser_rule_table, data, strlen(data), rootp);
+	if (ret < 0) {
+		perror("test/cut: libparser_parse_file");
+		exit(1);
+	}
+	return ret;
+}
+
+
+int
+main(void)
+{
+	struct libparser_unit *plain, *cut;
+	size_t i;
+	int plain_ret, cut_ret, failed = 0;
+
+	for (i = 0; i < sizeof(good) / sizeof(*good); i++) {
+		plain_ret = parse('-', good[i], &plain);
+		cut_ret = parse('^', good[i], &cut);
+		if (plain_ret != cut_ret || !same_tree(plain, cut)) {
+			fprintf(stderr, "test/cut: tree differs with cuts for \"%s\"\n", good[i]);
+			failed = 1;
+		}
+		free_tree(plain);
+		free_tree(cut);
+	}
+
+	for (i = 0; i < sizeof(bad) / sizeof(*bad); i++) {
+		plain_ret = parse('-', bad[i], &plain);
+		cut_ret = parse('^', bad[i], &cut);
+		if (plain_ret != 1 || cut_ret != 0) {
+			fprintf(stderr, "test/cut: \"%s\" returned %i without cuts and %i with cuts, rather than 1 and 0\n",
+			        bad[i], plain_ret, cut_ret);
+			failed = 1;
+		}
+		free_tree(plain);
+		free_tree(cut);
+	}
+
+	return failed;
+}
@@ -0,0 +1,192 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libparser.h>
+
+
+#define MAX_NODES 4096
+
+
+static const char *const inputs[] = {
+	"1",
+	"12 + 3 * (4 - 5'6) - 7 / 8",
+	"((((1))))",
+	"-1 + +2",
+	"1 2 (3)",
+	"1 +",
+	"(1",
+	"1 * ",
+	"1 (* comment *) + 2",
+	"+",
+	""
+};
+
+
+struct node {
+	const char *rule;
+	size_t start;
+	size_t end;
+	size_t depth;
+	int open;
+};
+
+/* The tree built from the events, in preorder */
+struct tree {
+	struct node nodes[MAX_NODES];
+	size_t count;
+	size_t depth; /* number of nodes entered but not left */
+	int error;
+};
+
+
+static void
+enter(const char *rule, size_t start, void *user)
+{
+	struct tree *tree = user;
+	if (tree->count == MAX_NODES) {
+		tree->error = 1;
+		return;
+	}
+	tree->nodes[tree->count].rule = rule;
+	tree->nodes[tree->count].start = start;
+	tree->nodes[tree->count].end = start;
+	tree->nodes[tree->count].depth = tree->depth++;
+	tree->nodes[tree->count].open = 1;
+	tree->count += 1;
+}
+
+
+static void
+leave(const char *rule, size_t start, size_t end, void *user)
+{
+	struct tree *tree = user;
+	size_t i = tree->count;
+
+	/* the innermost open node must be the one left */
+	while (i && !tree->nodes[i - 1].open)
+		i--;
+	if (!i || tree->nodes[i - 1].rule != rule || tree->nodes[i - 1].start != start || end < start) {
+		tree->error = 1;
+		return;
+	}
+	tree->nodes[i - 1].end = end;
+	tree->nodes[i - 1].open = 0;
+	tree->depth -= 1;
+}
+
+
+static void
+retract(const char *rule, size_t start, void *user)
+{
+	struct tree *tree = user;
+
+	/* the node entered last must be the one retracted */
+	if (!tree->count || tree->nodes[tree->count - 1].rule != rule || tree->nodes[tree->count - 1].start != start) {
+		tree->error = 1;
+		return;
+	}
+	tree->count -= 1;
+	if (tree->nodes[tree->count].open)
+		tree->depth -= 1;
+}
+
+
+/* Add the nodes of a parse tree, except units without a rule,
+ * which are not reported as events, but whose children are */
+static void
+add_units(const struct libparser_unit *unit, size_t depth, struct tree *tree)
+{
+	for (; unit; unit = unit->next) {
+		if (!unit->rule) {
+			add_units(unit->in, depth, tree);
+			continue;
+		}
+		if (tree->count == MAX_NODES) {
+			tree->error = 1;
+			return;
+		}
+		tree->nodes[tree->count].rule = unit->rule;
+		tree->nodes[tree->count].start = unit->start;
+		tree->nodes[tree->count].end = unit->end;
+		tree->nodes[tree->count].depth = depth;
+		tree->nodes[tree->count].open = 0;
+		tree->count += 1;
+		add_units(unit->in, depth + 1, tree);
+	}
+}
+
+
+static void
+free_tree(struct libparser_unit *unit)
+{
+	struct libparser_unit *next;
+	for (; unit; unit = next) {
+		free_tree(unit->in);
+		next = unit->next;
+		free(unit);
+	}
+}
+
+
+static int
+check(const char *data)
+{
+	static struct tree expected, got;
+	struct libparser_events events;
+	struct libparser_unit *root;
+	size_t i;
+	int ret, events_ret;
+
+	memset(&expected, 0, sizeof(expected));
+	memset(&got, 0, sizeof(got));
+
+	ret = libparser_parse_file(libparser_rule_table, data, strlen(data), &root);
+	if (ret < 0) {
+		perror("test/events: libparser_parse_file");
+		exit(1);
+	}
+	add_units(root, 0, &expected);
+	free_tree(root);
+
+	events.enter = enter;
+	events.leave = leave;
+	events.retract = retract;
+	events.user = &got;
+	events_ret = libparser_parse_events(libparser_rule_table, data, strlen(data), NULL, &events);
+	if (events_ret < 0) {
+		perror("test/events: libparser_parse_events");
+		exit(1);
+	}
+
+	if (got.error) {
+		fprintf(stderr, "test/events: events are not nested for \"%s\"\n", data);
+		return 1;
+	}
+	if (ret != events_ret || got.depth || got.count != expected.count)
+		goto differs;
+	for (i = 0; i < got.count; i++) {
+		if (got.nodes[i].start != expected.nodes[i].start || got.nodes[i].end != expected.nodes[i].end ||
+		    got.nodes[i].depth != expected.nodes[i].depth ||
+		    (got.nodes[i].rule ? !expected.nodes[i].rule || strcmp(got.nodes[i].rule, expected.nodes[i].rule)
+		                       : !!expected.nodes[i].rule))
+			goto differs;
+	}
+	return 0;
+
+differs:
+	fprintf(stderr, "test/events: tree differs for \"%s\"\n", data);
+	return 1;
+}
+
+
+int
+main(void)
+{
+	size_t i;
+	int failed = 0;
+
+	for (i = 0; i < sizeof(inputs) / sizeof(*inputs); i++)
+		failed |= check(inputs[i]);
+	return failed;
+}
@@ -0,0 +1,114 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libparser.h>
+
+
+static const char *const inputs[] = {
+	"1",
+	"12 + 3 * (4 - 5'6) - 7 / 8",
+	"((((1))))",
+	"-1 + +2",
+	"1 +",
+	"(1",
+	"1 2",
+	""
+};
+
+
+static void
+free_tree(struct libparser_unit *unit)
+{
+	struct libparser_unit *next;
+	for (; unit; unit = next) {
+		free_tree(unit->in);
+		next = unit->next;
+		free(unit);
+	}
+}
+
+
+static uint32_t
+rule_id(const char *rule)
+{
+	uint32_t i;
+	if (rule)
+		for (i = 0; libparser_rule_table[i]; i++)
+			if (!strcmp(libparser_rule_table[i]->name, rule))
+				return i;
+	return LIBPARSER_NO_RULE;
+}
+
+
+/* Check that the nodes from index i onwards, linked by .next, are the units in
+ * the list unit, in preorder, and return the index after the last of them */
+static size_t
+check_list(const struct libparser_flat_tree *tree, size_t i, const struct libparser_unit *unit)
+{
+	uint32_t rule, in, next;
+	uint64_t start, end;
+
+	for (; unit; unit = unit->next) {
+		if (i >= tree->count)
+			return 0;
+		if (tree->units64) {
+			rule = tree->units64[i].rule, in = tree->units64[i].in, next = tree->units64[i].next;
+			start = tree->units64[i].start, end = tree->units64[i].end;
+		} else {
+			rule = tree->units[i].rule, in = tree->units[i].in, next = tree->units[i].next;
+			start = tree->units[i].start, end = tree->units[i].end;
+		}
+		if (rule != rule_id(unit->rule) || start != unit->start || end != unit->end || !in != !unit->in)
+			return 0;
+		if (!unit->in)
+			i += 1;
+		else if (in != i + 1 || !(i = check_list(tree, i + 1, unit->in)))
+			return 0;
+		if (unit->next ? next != i : next != 0)
+			return 0;
+	}
+	return i;
+}
+
+
+static int
+check(const char *data, int flags)
+{
+	struct libparser_options options;
+	struct libparser_flat_tree tree;
+	struct libparser_unit *root;
+	int ret, flat_ret, failed = 0;
+
+	memset(&options, 0, sizeof(options));
+	options.flags = flags;
+
+	ret = libparser_parse_file(libparser_rule_table, data, strlen(data), &root);
+	flat_ret = libparser_parse_flat(libparser_rule_table, data, strlen(data), &options, &tree);
+	if (ret < 0 || flat_ret < 0) {
+		perror("test/flat: parse failed");
+		exit(1);
+	}
+	if ((tree.count && !(flags & LIBPARSER_FLAT_WIDE) != !tree.units64) || ret != flat_ret ||
+	    check_list(&tree, 0, root) != tree.count) {
+		fprintf(stderr, "test/flat: tree differs for \"%s\"%s\n", data, flags ? " with LIBPARSER_FLAT_WIDE" : "");
+		failed = 1;
+	}
+	free_tree(root);
+	libparser_free_flat_tree(&tree);
+	return failed;
+}
+
+
+int
+main(void)
+{
+	size_t i;
+	int failed = 0;
+
+	for (i = 0; i < sizeof(inputs) / sizeof(*inputs); i++) {
+		failed |= check(inputs[i], 0);
+		failed |= check(inputs[i], LIBPARSER_FLAT_WIDE);
+	}
+	return failed;
+}
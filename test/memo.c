@@ -0,0 +1,118 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <libparser.h>
+
+
+#define DEPTH 20000
+#define RUNS 3
+
+
+struct node {
+	const char *rule;
+	size_t start;
+	size_t end;
+	size_t children;
+};
+
+
+static unsigned long long int
+now(void)
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
+		perror("clock_gettime");
+		exit(1);
+	}
+	return (unsigned long long int)ts.tv_sec * 1000000000ULL + (unsigned long long int)ts.tv_nsec;
+}
+
+
+/* Deallocate a tree, listing its nodes in preorder so that trees can be compared */
+static size_t
+flatten(struct libparser_unit *unit, struct node *nodes)
+{
+	struct libparser_unit *next, *last;
+	size_t n = 0;
+	for (; unit; unit = next, n++) {
+		nodes[n].rule = unit->rule;
+		nodes[n].start = unit->start;
+		nodes[n].end = unit->end;
+		nodes[n].children = 0;
+		if (unit->in) {
+			for (last = unit->in; last->next; last = last->next)
+				nodes[n].children += 1;
+			nodes[n].children += 1;
+			last->next = unit->next;
+			unit->next = unit->in;
+		}
+		next = unit->next;
+		free(unit);
+	}
+	return n;
+}
+
+
+static unsigned long long int
+parse(const char *data, size_t length, int flags, struct node *nodes, size_t *countp)
+{
+	struct libparser_options options;
+	struct libparser_unit *root;
+	unsigned long long int start, elapsed, best = 0;
+	int i, ret;
+
+	memset(&options, 0, sizeof(options));
+	options.flags = flags;
+	for (i = 0; i < RUNS; i++) {
+		start = now();
+		ret = libparser_parse_file_with_options(libparser_rule_table, data, length, &options, &root);
+		elapsed = now() - start;
+		if (ret != 1) {
+			fprintf(stderr, "test/memo: parse failed: %i\n", ret);
+			exit(1);
+		}
+		*countp = flatten(root, nodes);
+		if (!i || elapsed < best)
+			best = elapsed;
+	}
+	return best;
+}
+
+
+int
+main(void)
+{
+	static char data[2 * DEPTH + 1];
+	static struct node plain_nodes[8 * DEPTH], memo_nodes[8 * DEPTH];
+	unsigned long long int plain, memo;
+	size_t plain_count, memo_count, i;
+
+	memset(data, '(', DEPTH);
+	data[DEPTH] = '1';
+	memset(&data[DEPTH + 1], ')', DEPTH);
+
+	plain = parse(data, sizeof(data), 0, plain_nodes, &plain_count);
+	memo = parse(data, sizeof(data), LIBPARSER_MEMOISE, memo_nodes, &memo_count);
+
+	if (plain_count != memo_count) {
+		fprintf(stderr, "test/memo: %zu nodes with LIBPARSER_MEMOISE, %zu without\n", memo_count, plain_count);
+		return 1;
+	}
+	for (i = 0; i < plain_count; i++) {
+		if (memo_nodes[i].start != plain_nodes[i].start || memo_nodes[i].end != plain_nodes[i].end ||
+		    memo_nodes[i].children != plain_nodes[i].children ||
+		    (memo_nodes[i].rule ? !plain_nodes[i].rule || strcmp(memo_nodes[i].rule, plain_nodes[i].rule) : !!plain_nodes[i].rule)) {
+			fprintf(stderr, "test/memo: node %zu differs with LIBPARSER_MEMOISE\n", i);
+			return 1;
+		}
+	}
+
+	/* the memo costs a lookup per rule, but must not change how the time grows with the nesting */
+	if (memo > 2 * plain + 1000000ULL) {
+		fprintf(stderr, "test/memo: %llu ns with LIBPARSER_MEMOISE, %llu ns without\n", memo, plain);
+		return 1;
+	}
+	return 0;
+}
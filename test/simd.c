@@ -0,0 +1,101 @@
+/* See LICENSE file for copyright and license details. */
+/* The scanners are not exported, so they are tested from within libparser.c */
+#include "../libparser.c"
+
+#include <stdio.h>
+
+
+#define MAX_LENGTH 100
+#define MAX_OFFSET 32
+
+
+static void
+add_range(unsigned char set[32], unsigned low, unsigned high)
+{
+	for (; low <= high; low++)
+		set[low >> 3] |= (unsigned char)(1 << (low & 7));
+}
+
+
+/* Compare the vectorised scanners with the scalar scanner for inputs
+ * that end, or have a byte outside the set, at every position relative
+ * to the 16-byte and 32-byte blocks the vectorised scanners read */
+static int
+check(const char *name, const unsigned char set[32])
+{
+	static unsigned char buffer[MAX_OFFSET + MAX_LENGTH];
+	static struct context ctx;
+	struct byte_class class;
+	unsigned char in[256], out[256];
+	const unsigned char *s;
+	size_t offset, length, stop, expected, i, nin = 0, nout = 0;
+	unsigned c;
+
+	for (c = 0; c < 256; c++) {
+		if (IN_SET(set, c))
+			in[nin++] = (unsigned char)c;
+		else
+			out[nout++] = (unsigned char)c;
+	}
+	init_byte_class(&class, set, set);
+	memset(ctx.classes, 0, sizeof(ctx.classes));
+
+	for (offset = 0; offset < MAX_OFFSET; offset++) {
+		s = &buffer[offset];
+		for (length = 0; length <= MAX_LENGTH; length++) {
+			for (stop = 0; stop <= length; stop++) {
+				for (i = 0; i < sizeof(buffer); i++)
+					buffer[i] = in[(i + stop) % nin];
+				if (stop < length)
+					buffer[offset + stop] = out[(offset + length) % nout];
+				expected = scan_scalar(&class, s, length);
+				if (expected != stop) {
+					fprintf(stderr, "test/simd: scalar scanner returned %zu rather than %zu for %s\n",
+					        expected, stop, name);
+					return 1;
+				}
+				if (scan_class(&ctx, set, set, s, length) != expected)
+					goto differs;
+#ifdef HAVE_X86_SIMD
+				if (class.nranges && scan_sse2(&class, s, length) != expected)
+					goto differs;
+				if (__builtin_cpu_supports("avx2") && scan_avx2(&class, s, length) != expected)
+					goto differs;
+#endif
+			}
+		}
+	}
+	return 0;
+
+differs:
+	fprintf(stderr, "test/simd: scanners differ for %s at offset %zu, length %zu, stop %zu\n", name, offset, length, stop);
+	return 1;
+}
+
+
+int
+main(void)
+{
+	unsigned char digits[32] = {0}, word[32] = {0}, scattered[32] = {0}, high[32] = {0};
+	unsigned c;
+	int failed = 0;
+
+	add_range(digits, '0', '9');
+
+	add_range(word, '0', '9');
+	add_range(word, 'A', 'Z');
+	add_range(word, '_', '_');
+	add_range(word, 'a', 'z');
+
+	for (c = 0; c < 256; c += 3)
+		add_range(scattered, c, c);
+
+	add_range(high, 0x80, 0xFF);
+	add_range(high, ' ', ' ');
+
+	failed |= check("a single range", digits);
+	failed |= check("four ranges", word);
+	failed |= check("many ranges", scattered);
+	failed |= check("bytes with the high bit set", high);
+	return failed;
+}
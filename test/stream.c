@@ -0,0 +1,175 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libparser.h>
+
+
+#define TERMS 2000
+
+
+struct node {
+	const char *rule;
+	size_t start;
+	size_t end;
+};
+
+struct nodes {
+	struct node *nodes;
+	size_t count;
+	size_t size;
+};
+
+
+static void
+add_nodes(const struct libparser_unit *unit, struct nodes *nodes)
+{
+	for (; unit; unit = unit->next) {
+		if (nodes->count == nodes->size) {
+			nodes->size = nodes->size ? nodes->size * 2 : 64;
+			nodes->nodes = realloc(nodes->nodes, nodes->size * sizeof(*nodes->nodes));
+			if (!nodes->nodes) {
+				perror("test/stream: realloc");
+				exit(1);
+			}
+		}
+		nodes->nodes[nodes->count].rule = unit->rule;
+		nodes->nodes[nodes->count].start = unit->start;
+		nodes->nodes[nodes->count].end = unit->end;
+		nodes->count += 1;
+		add_nodes(unit->in, nodes);
+	}
+}
+
+
+static void
+free_tree(struct libparser_unit *unit)
+{
+	struct libparser_unit *next;
+	for (; unit; unit = next) {
+		free_tree(unit->in);
+		next = unit->next;
+		free(unit);
+	}
+}
+
+
+static int
+same_nodes(const struct node *a, const struct node *b, size_t count)
+{
+	for (; count--; a++, b++)
+		if (a->start != b->start || a->end != b->end || (a->rule ? !b->rule || strcmp(a->rule, b->rule) : !!b->rule))
+			return 0;
+	return 1;
+}
+
+
+static void
+deliver(struct libparser_unit *unit, const char *text, void *user)
+{
+	(void) text;
+	add_nodes(unit, user);
+}
+
+
+/* Parse in chunks, checking that the units given to the callback,
+ * which must be consecutive nodes of the parse tree, together with
+ * the final tree, are the tree libparser_parse_file builds */
+static size_t
+check(const struct libparser_rule *const rules[], const char *data, size_t length, size_t chunk,
+      const struct nodes *expected, int expected_ret)
+{
+	struct libparser_stream *stream;
+	struct libparser_unit *root;
+	struct nodes delivered = {NULL, 0, 0}, rest = {NULL, 0, 0};
+	size_t i, n;
+	int ret;
+
+	stream = libparser_stream_create(rules, NULL, deliver, &delivered);
+	if (!stream) {
+		perror("test/stream: libparser_stream_create");
+		exit(1);
+	}
+	for (i = 0; i < length; i += n) {
+		n = length - i < chunk ? length - i : chunk;
+		if (libparser_stream_feed(stream, &data[i], n) != LIBPARSER_NEED_INPUT)
+			break;
+	}
+	ret = libparser_stream_end(stream, &root);
+	libparser_stream_free(stream);
+	if (ret != expected_ret) {
+		fprintf(stderr, "test/stream: returned %i in chunks of %zu bytes, rather than %i\n", ret, chunk, expected_ret);
+		exit(1);
+	}
+	add_nodes(root, &rest);
+	free_tree(root);
+
+	for (i = 0; i < rest.count && i < expected->count && same_nodes(&rest.nodes[i], &expected->nodes[i], 1); i++);
+	if (delivered.count + rest.count != expected->count ||
+	    !same_nodes(delivered.nodes, &expected->nodes[i], delivered.count) ||
+	    !same_nodes(&rest.nodes[i], &expected->nodes[i + delivered.count], rest.count - i)) {
+		fprintf(stderr, "test/stream: tree differs in chunks of %zu bytes\n", chunk);
+		exit(1);
+	}
+
+	free(delivered.nodes);
+	free(rest.nodes);
+	return delivered.count;
+}
+
+
+static size_t
+check_all(const struct libparser_rule *const rules[], const char *data, size_t length)
+{
+	static const size_t chunks[] = {1, 7, 4096};
+	struct libparser_unit *root;
+	struct nodes expected = {NULL, 0, 0};
+	size_t i, delivered = 0;
+	int ret;
+
+	ret = libparser_parse_file(rules, data, length, &root);
+	if (ret < 0) {
+		perror("test/stream: libparser_parse_file");
+		exit(1);
+	}
+	add_nodes(root, &expected);
+	free_tree(root);
+
+	for (i = 0; i < sizeof(chunks) / sizeof(*chunks); i++)
+		delivered += check(rules, data, length, chunks[i], &expected, ret);
+	free(expected.nodes);
+	return delivered;
+}
+
+
+int
+main(void)
+{
+	static const char term[] = "12 + 3 * (4 - 5'6) - 7 / 8 ";
+	static char data[TERMS * (sizeof(term) - 1) + 1];
+	static union libparser_sentence hyper1 = {.rule = {.type = LIBPARSER_SENTENCE_TYPE_RULE, .rule = "hyper1"}};
+	static struct libparser_rule start = {"@start", &hyper1};
+	const struct libparser_rule *rules[64];
+	size_t i, n = 0;
+
+	for (i = 0; i < TERMS; i++)
+		memcpy(&data[i * (sizeof(term) - 1)], term, sizeof(term) - 1);
+	data[TERMS * (sizeof(term) - 1)] = '9';
+
+	/* hyper1 is not the main rule, so none of its units may be handed to the callback */
+	if (check_all(libparser_rule_table, data, sizeof(data))) {
+		fprintf(stderr, "test/stream: units of a rule used by the main rule were delivered\n");
+		return 1;
+	}
+
+	rules[n++] = &start;
+	for (i = 0; libparser_rule_table[i] && n + 1 < sizeof(rules) / sizeof(*rules); i++)
+		if (strcmp(libparser_rule_table[i]->name, "@start"))
+			rules[n++] = libparser_rule_table[i];
+	rules[n] = NULL;
+	if (!check_all(rules, data, sizeof(data))) {
+		fprintf(stderr, "test/stream: no units were delivered from the main rule\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,103 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libparser.h>
+
+
+static const char *const inputs[] = {
+	"1",
+	"12+3*(45-6)/7",
+	"((((1))))",
+	"1+",
+	"(1",
+	"1++2",
+	"1)",
+	"+",
+	""
+};
+
+
+static int
+same_tree(const struct libparser_unit *a, const struct libparser_unit *b)
+{
+	for (; a && b; a = a->next, b = b->next) {
+		if (a->start != b->start || a->end != b->end || (a->rule ? !b->rule || strcmp(a->rule, b->rule) : !!b->rule))
+			return 0;
+		if (!same_tree(a->in, b->in))
+			return 0;
+	}
+	return !a && !b;
+}
+
+
+static void
+free_tree(struct libparser_unit *unit)
+{
+	struct libparser_unit *next;
+	for (; unit; unit = next) {
+		free_tree(unit->in);
+		next = unit->next;
+		free(unit);
+	}
+}
+
+
+static unsigned int
+token_type(const char *name)
+{
+	unsigned int i;
+	for (i = 0; libparser_token_type_table[i]; i++)
+		if (!strcmp(libparser_token_type_table[i], name))
+			return i;
+	fprintf(stderr, "test/token: no token type named %s\n", name);
+	exit(1);
+}
+
+
+/* Split the input into one token per byte */
+static size_t
+lex(const char *data, struct libparser_token *tokens)
+{
+	size_t i;
+	for (i = 0; data[i]; i++) {
+		if (data[i] >= '0' && data[i] <= '9')
+			tokens[i].type = token_type("digit");
+		else if (data[i] == '(')
+			tokens[i].type = token_type("open");
+		else if (data[i] == ')')
+			tokens[i].type = token_type("close");
+		else
+			tokens[i].type = token_type("op");
+		tokens[i].start = i;
+		tokens[i].end = i + 1;
+	}
+	return i;
+}
+
+
+int
+main(void)
+{
+	struct libparser_token tokens[64];
+	struct libparser_unit *root, *token_root;
+	size_t i, count;
+	int ret, token_ret, failed = 0;
+
+	for (i = 0; i < sizeof(inputs) / sizeof(*inputs); i++) {
+		count = lex(inputs[i], tokens);
+		ret = libparser_parse_file(libparser_rule_table, inputs[i], strlen(inputs[i]), &root);
+		token_ret = libparser_parse_tokens(libparser_rule_table, tokens, count, NULL, &token_root);
+		if (ret < 0 || token_ret < 0) {
+			perror("test/token: parse failed");
+			exit(1);
+		}
+		if (ret != token_ret || !same_tree(root, token_root)) {
+			fprintf(stderr, "test/token: tree differs for \"%s\"\n", inputs[i]);
+			failed = 1;
+		}
+		free_tree(root);
+		free_tree(token_root);
+	}
+	return failed;
+}